@@ -26,14 +26,46 @@
 #include "cinder/Filesystem.h"
 #include "cinder/Noncopyable.h"
 
+#include <boost/version.hpp>
+
+#include <algorithm>
+#include <unordered_map>
+
 #include "FileMonitor.h"
+#include "ContentDigest.h"
+#include "EpochReclaimer.h"
+#include "InplaceFunction.h"
+#include "SlotMap.h"
 
 namespace filewatcher {
 	
 // expose internal event types
 typedef filemonitor::FileMonitorEvent::EventType EventType;
+
+// expose watch options
+using filemonitor::WatchFlags;
+using filemonitor::WATCH_DEFAULT;
+using filemonitor::WATCH_PENDING;
+using filemonitor::WATCH_FOLLOW_SYMLINKS;
+using filemonitor::WATCH_CONTENT_HASH;
 	
-typedef std::function<void ( const ci::fs::path&, EventType type )> WatchCallback;
+//! Move-only and stored inline, captures must fit in 64 bytes
+typedef filemonitor::InplaceFunction<void ( const ci::fs::path&, EventType type )> WatchCallback;
+
+//! A change reported to batch callbacks
+typedef std::pair<ci::fs::path, EventType> WatchEvent;
+
+//! Receives everything that happened to a watch since its last dispatch, one entry per
+//! path in the order paths first changed.  Types are coalesced, an ADDED file that is
+//! then modified is reported as ADDED, and one that is added and removed again is dropped.
+typedef filemonitor::InplaceFunction<void ( const std::vector<WatchEvent> &events )> WatchBatchCallback;
+
+//! Completion signature of asyncNextEvents(), ec is operation_aborted if the watch was
+//! removed while waiting
+typedef void ( WatchEventsSignature )( boost::system::error_code ec, std::vector<WatchEvent> events );
+
+//! Completion for asynchronous registration, ec is set if the watch could not be armed
+typedef std::function<void ( const ci::fs::path&, const boost::system::error_code &ec )> WatchArmedCallback;
 	
 class WatchedTarget;
 
@@ -45,18 +77,183 @@ class FileWatcher {
   friend class WatchedTarget;
 	
   public:
+	//! Creates an independent watcher with its own backend, io_service and callbacks
+	FileWatcher();
+	
+	//! Creates a watcher that registers its watches with backend's monitor, sharing its OS
+	//! resources, but keeps its own callbacks and dispatch queue.  Events are handed over
+	//! when backend is polled (or dispatches immediately), so this instance receives
+	//! nothing unless backend is polled as well.  backend must outlive it.
+	explicit FileWatcher( FileWatcher *backend );
+	
+	//! Default watcher used by the static watch functions
 	static FileWatcher *instance();
 
-	//! Creates a watch of a single file
+	//! Creates a watch of a single file.  With WATCH_PENDING the file, and any of its
+	//! parent directories, may be created later and ADDED is reported when it appears.
 	static WatchedTarget watchFile( const ci::fs::path &file,
-								    const WatchCallback &callback );
+								    WatchCallback callback,
+								    uint32_t flags = WATCH_DEFAULT );
 	
-	//! Creates a watch of a directory and subdirectories given a regex match
+	//! Creates a watch of a directory and subdirectories given a regex match.
+	//! Optional excludes skip whole subtrees ("node_modules/") or filename globs ("*.tmp")
+	//! before they reach the regex, and where possible before the OS reports them.
 	static WatchedTarget watchPath( const ci::fs::path &path,
 								    const std::string &regex,
-								    const WatchCallback &callback );
+								    WatchCallback callback,
+								    const std::vector<std::string> &excludes = std::vector<std::string>(),
+								    uint32_t flags = WATCH_DEFAULT );
+
+	//! Creates a watch of a directory without blocking the caller.  The target is returned
+	//! right away and the backend is armed in the background, armed is called from poll()
+	//! / update() once it is live.  Changes made while arming are replayed, not dropped.
+	//! With WATCH_FOLLOW_SYMLINKS the links are resolved while arming, too.
+	static WatchedTarget watchPathAsync( const ci::fs::path &path,
+										 const std::string &regex,
+										 WatchCallback callback,
+										 const WatchArmedCallback &armed,
+										 const std::vector<std::string> &excludes = std::vector<std::string>(),
+										 uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a single file that receives its events in batches
+	static WatchedTarget watchFileBatch( const ci::fs::path &file,
+										 WatchBatchCallback callback,
+										 uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a directory that receives its events in batches, once per
+	//! poll() / update() that has changes for it
+	static WatchedTarget watchPathBatch( const ci::fs::path &path,
+										 const std::string &regex,
+										 WatchBatchCallback callback,
+										 const std::vector<std::string> &excludes = std::vector<std::string>(),
+										 uint32_t flags = WATCH_DEFAULT );
+	
+	//! watchFile() on this instance
+	WatchedTarget addFileWatch( const ci::fs::path &file,
+								WatchCallback callback,
+								uint32_t flags = WATCH_DEFAULT );
+	
+	//! watchPath() on this instance
+	WatchedTarget addPathWatch( const ci::fs::path &path,
+								const std::string &regex,
+								WatchCallback callback,
+								const std::vector<std::string> &excludes = std::vector<std::string>(),
+								uint32_t flags = WATCH_DEFAULT );
+	
+	//! watchPathAsync() on this instance
+	WatchedTarget addPathWatchAsync( const ci::fs::path &path,
+									 const std::string &regex,
+									 WatchCallback callback,
+									 const WatchArmedCallback &armed,
+									 const std::vector<std::string> &excludes = std::vector<std::string>(),
+									 uint32_t flags = WATCH_DEFAULT );
+	
+	//! watchFileBatch() on this instance
+	WatchedTarget addFileWatchBatch( const ci::fs::path &file,
+									 WatchBatchCallback callback,
+									 uint32_t flags = WATCH_DEFAULT );
+	
+	//! watchPathBatch() on this instance
+	WatchedTarget addPathWatchBatch( const ci::fs::path &path,
+									 const std::string &regex,
+									 WatchBatchCallback callback,
+									 const std::vector<std::string> &excludes = std::vector<std::string>(),
+									 uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a single file without a callback, its events are buffered
+	//! until they're taken with WatchedTarget::asyncNextEvents()
+	WatchedTarget addFileStream( const ci::fs::path &file,
+								 uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a directory whose events are taken with asyncNextEvents()
+	WatchedTarget addPathStream( const ci::fs::path &path,
+								 const std::string &regex,
+								 const std::vector<std::string> &excludes = std::vector<std::string>(),
+								 uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a single file whose events are queued in a ring of capacity
+	//! entries owned by the returned target, consumed with WatchedTarget::tryPop() /
+	//! drain().  Events skip the io_service and callbacks entirely, and with them
+	//! content hashing: WATCH_CONTENT_HASH throws std::invalid_argument.
+	WatchedTarget addFileChannel( const ci::fs::path &file,
+								  size_t capacity = 1024,
+								  uint32_t flags = WATCH_DEFAULT );
+	
+	//! Creates a watch of a directory consumed through a channel, see addFileChannel()
+	WatchedTarget addPathChannel( const ci::fs::path &path,
+								  const std::string &regex,
+								  size_t capacity = 1024,
+								  const std::vector<std::string> &excludes = std::vector<std::string>(),
+								  uint32_t flags = WATCH_DEFAULT );
+	
+	//! Completes with up to maxEvents buffered events of a stream watch, waiting for
+	//! the next change if none are buffered.  Takes any asio completion token, a plain
+	//! handler or a yield_context, and use_awaitable for `co_await` with Boost 1.70+ and
+	//! C++20.  From Boost 1.66 the handler runs on its associated executor, before that
+	//! it's posted to mIoService through its invocation hook, so strand wrapped handlers
+	//! still run on their strand.  Only one wait per watch can be outstanding.
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_RESULT_TYPE( CompletionToken, WatchEventsSignature )
+	asyncNextEvents( uint64_t wid, size_t maxEvents, CompletionToken &&token )
+	{
+#if BOOST_VERSION >= 106600
+		boost::asio::async_completion<CompletionToken, WatchEventsSignature> init( token );
+		typedef typename boost::asio::async_completion<CompletionToken, WatchEventsSignature>::completion_handler_type Handler;
+		waitEvents( wid, maxEvents, std::unique_ptr<EventWaiter>(
+			new HandlerWaiter<Handler>( std::move( init.completion_handler ), *this ) ) );
+		return init.result.get();
+#else
+		typedef typename boost::asio::handler_type<CompletionToken, WatchEventsSignature>::type Handler;
+		Handler handler( std::forward<CompletionToken>( token ) );
+		boost::asio::async_result<Handler> result( handler );
+		waitEvents( wid, maxEvents, std::unique_ptr<EventWaiter>(
+			new HandlerWaiter<Handler>( std::move( handler ), *this ) ) );
+		return result.get();
+#endif
+	}
+	
+	//! Caps how many watch roots are handed to the OS, 0 is unlimited.  Once exceeded,
+	//! the least recently active subtrees are polled until budget frees up again.
+	//! Applies to the backend's monitor, i.e. to every instance sharing it.
+	void setWatchBudget( size_t maxRoots );
+	
+	//! Stages watch adds and removes until commitBatch(), which applies them to the
+	//! backend in a single pass.  Batches can be nested, only the outermost commits.
+	//! The batch is the backend's, instances sharing it stage their changes into it too.
+	void beginBatch();
+	
+	//! Applies all watch changes staged since beginBatch(), including those of instances
+	//! sharing the backend
+	void commitBatch();
+	
+	//! Runs callbacks on a pool of threads instead of the thread calling poll() / update(),
+	//! 0 (the default) switches back.  Callbacks of different watches run concurrently,
+	//! those of a single watch stay serialized and in order.  Call from the polling thread.
+	void setCallbackThreads( size_t threads );
+	
+	//! Caps the time poll() / update() spend running callbacks, 0 (the default) runs
+	//! everything that is ready.  Events left over are carried to the next call, at least
+	//! one event is dispatched per call so the backlog always drains.
+	void setUpdateBudget( std::chrono::microseconds budget );
+	
+	//! Number of events that were ready but deferred to a later poll() / update(), always 0
+	//! with immediate dispatch.  Call from the polling thread.
+	size_t getDeferredCount() const;
+	
+	//! Seconds the OS may hold changes back to coalesce them, 1 by default
+	void setLatency( double seconds );
+	
+	//! Delivers callbacks from a dedicated thread as soon as events arrive, rather than
+	//! from poll() / update(), which then do nothing.  Callbacks must be thread safe.
+	void setImmediateDispatch( bool immediate );
+	
+	//! Called from a background thread whenever events are ready, so an external loop
+	//! can wake up and call poll() right away instead of on its next iteration.  On an
+	//! instance sharing a backend it fires once the backend hands events over, which
+	//! only happens while the backend is polled.
+	void setWakeCallback( const std::function<void ()> &wake );
 
-	~FileWatcher() { mAsioWork.reset(); }
+	~FileWatcher();
 	
 	//! Registers update routine with current cinder app
 	void registerUpdate();
@@ -64,27 +261,293 @@ class FileWatcher {
 	//! Polls the asio service to check for updates
 	void poll();
 	
+	//! Updates routine can be synced with cinder if desired.  Same as poll(), but returns
+	//! right away when the monitor has nothing queued
+	void update();
+	
+	//! Number of watches registered with the backend, including those of instances sharing it
+	size_t getWatchCount();
+	
+	//! Number of times poll() / update() ran the io_service, idle update() calls don't count
+	size_t getServicePollCount() const { return mServicePolls; }
+	
 	
   private:
 	
-	FileWatcher();
+	//! Type erased asyncNextEvents() handler, one allocation per wait rather than per event
+	struct EventWaiter {
+		virtual ~EventWaiter() { }
+		//! Hands events to the handler.  Completions from inside asyncNextEvents() are
+		//! posted, the others may run the handler inline if it's already on its executor
+		virtual void complete( const boost::system::error_code &ec, std::vector<WatchEvent> events, bool posted ) = 0;
+	};
+	
+	//! Counts a completion in mWaiterHandlers until it has run, so update() doesn't
+	//! skip polling while one is queued on mIoService
+	template <typename Bound>
+	struct CountedCompletion {
+		void operator()()
+		{
+			mPending->fetch_sub( 1, std::memory_order_relaxed );
+			mBound();
+		}
+		
+		//! runs the completion wherever the bound handler's own hook says, e.g. its strand
+		template <typename Function>
+		friend void asio_handler_invoke( Function &function, CountedCompletion *self )
+		{
+			boost_asio_handler_invoke_helpers::invoke( function, self->mBound );
+		}
+		
+		std::atomic<size_t>		*mPending;
+		Bound					mBound;
+	};
+	
+	template <typename Handler>
+	struct HandlerWaiter : public EventWaiter {
+		HandlerWaiter( Handler &&handler, FileWatcher &watcher )
+		: mHandler( std::move( handler ) ), mWatcher( watcher )
+		{ }
+		
+		void complete( const boost::system::error_code &ec, std::vector<WatchEvent> events, bool posted ) override
+		{
+			typedef decltype( boost::asio::detail::bind_handler( std::move( mHandler ), ec, std::move( events ) ) ) Bound;
+			CountedCompletion<Bound> counted{ &mWatcher.mWaiterHandlers,
+				boost::asio::detail::bind_handler( std::move( mHandler ), ec, std::move( events ) ) };
+			mWatcher.mWaiterHandlers.fetch_add( 1, std::memory_order_relaxed );
+#if BOOST_VERSION >= 106600
+			auto executor = boost::asio::get_associated_executor( counted.mBound.handler_, mWatcher.mIoService.get_executor() );
+			if( posted ) {
+				boost::asio::post( executor, std::move( counted ) );
+			} else {
+				boost::asio::dispatch( executor, std::move( counted ) );
+			}
+#else
+			if( posted ) {
+				mWatcher.mIoService.post( std::move( counted ) );
+			} else {
+				mWatcher.mIoService.dispatch( std::move( counted ) );
+			}
+#endif
+		}
+		
+		Handler			mHandler;
+		FileWatcher		&mWatcher;
+	};
+	
+	//! Per watch buffer of a stream watch, shared by the dispatching thread and the consumer
+	struct EventStream {
+		std::mutex						mutex;
+		std::vector<WatchEvent>			buffered;
+		std::unique_ptr<EventWaiter>	waiter;
+		size_t							maxEvents = 0;
+		//! queued in mReadyStreams for the current dispatch
+		bool							scheduled = false;
+	};
+	
+	//! Callback registered for a watch handle, immutable once published.  Replacing or
+	//! removing a callback retires the old one, it stays valid for callbacks in flight.
+	//! Retired entries are recycled through mFreeCallbacks, so registering doesn't allocate
+	struct RegisteredCallback {
+		WatchCallback		callback;
+		//! set instead of callback for watches taking their events in batches
+		WatchBatchCallback	batchCallback;
+		//! set instead of either callback for stream watches
+		std::shared_ptr<EventStream>	stream;
+	};
+	
+	//! Events collected for a batch watch during one dispatch
+	struct PendingBatch {
+		std::vector<WatchEvent>								events;
+		//! position of each path in events, for coalescing
+		std::unordered_map<std::string, size_t>				index;
+	};
+	
+	//! Slot owned by a watch handle, read by dispatch without locking
+	struct CallbackSlot {
+		CallbackSlot()
+		: wid( 0 ), registered( nullptr )
+		{ }
+		
+		//! 0 when the slot is unused, otherwise the full handle including its generation
+		std::atomic<uint64_t>				wid;
+		std::atomic<RegisteredCallback*>	registered;
+	};
+	
+	//! Slots live in fixed size chunks that are never moved or freed while the watcher
+	//! lives, so a dispatching thread can't be left holding a dangling slot
+	static const size_t sCallbackChunkSize = 256;
+	static const size_t sCallbackChunks = 4096;
+	
+	struct CallbackChunk {
+		CallbackSlot	slots[sCallbackChunkSize];
+	};
+	
+	FileWatcher( const FileWatcher & ) = delete;
+	FileWatcher &operator=( const FileWatcher & ) = delete;
+	
+	//! Monitor the watches are registered with, owned by the backend instance
+	filemonitor::FileMonitor &monitor() { return *mBackend->mFileMonitor; }
+	
+	//! Registers callback for wid, and a forwarder with the backend if it's shared.
+	//! Takes ownership of registered.  Once the slots run out the watch is removed
+	//! again and std::length_error is thrown
+	void registerWatch( uint64_t wid, RegisteredCallback *registered );
+	
+	//! Called through the backend's forwarder, queues the event on this instance
+	void forwardEvent( uint64_t wid, const ci::fs::path &path, EventType type );
+	
+	//! Handlers posted to mIoService that haven't run yet
+	size_t pendingHandlers() const;
 	
 	//! WatchedObject deconstructors will call this
 	void removeWatch( uint64_t wid );
 	
-	void updateCallback( uint64_t wid, const WatchCallback &callback );
-
-	//! Updates routine can be synced with cinder if desired
-	void update();
+	void updateCallback( uint64_t wid, WatchCallback callback );
+	
+	void updateBatchCallback( uint64_t wid, WatchBatchCallback callback );
+	
+	//! Stores the callback in the slot owned by wid, returns false if the slot was taken
+	bool registerCallback( uint64_t wid, WatchCallback callback );
+	
+	//! Publishes registered in the slot owned by wid, deletes it and returns false if the
+	//! slot was taken
+	bool registerCallback( uint64_t wid, RegisteredCallback *registered );
+	
+	//! Returns the slot for wid's index, nullptr if its chunk was never allocated
+	CallbackSlot *findSlot( uint64_t wid ) const;
+	
+	//! Returns the callback registered for wid, or nullptr if wid is stale / unknown.
+	//! The result must only be used inside an EpochReclaimer::Guard
+	const RegisteredCallback *findCallback( uint64_t wid ) const;
+	
+	//! Swaps the slot's callback and retires the previous one
+	void replaceCallback( CallbackSlot &slot, RegisteredCallback *registered );
+	
+	//! Looks up and runs the callback for wid, on whichever thread calls it
+	void dispatchCallback( uint64_t wid, const ci::fs::path &path, EventType type );
+	
+	//! Lets queued callbacks finish and joins the executor threads
+	void stopExecutor();
+	
+	//! Last known contents of the files of a WATCH_CONTENT_HASH watch, only touched on
+	//! the watch's hashing strand
+	struct ContentHashes {
+		std::unordered_map<std::string, filemonitor::ContentDigest>	files;
+	};
+	
+	//! Returns the digests a WATCH_CONTENT_HASH watch starts from, null without the
+	//! flag.  Called before the watch is added, file is stat'ed for file watches
+	static std::shared_ptr<ContentHashes> contentBaseline( const ci::fs::path &file, uint32_t flags );
+	
+	//! Starts content hashing for wid, baselines in hashes are hashed right away
+	void watchContent( uint64_t wid, const std::shared_ptr<ContentHashes> &hashes );
+	
+	//! Queues an event for dispatch, events of content hashed watches take a detour
+	//! through their hashing strand first
+	void queueEvent( const filemonitor::FileMonitorEvent &ev );
+	
+	//! Updates the digests for ev, returns false if it's a MODIFIED with unchanged bytes
+	static bool checkContent( ContentHashes &hashes, const filemonitor::FileMonitorEvent &ev );
+	
+	//! Finishes queued hashing and joins the hashing threads
+	void stopContentHashing();
+	
+	//! Hands an event to its callback, directly or through the executor.  Events for
+	//! batch watches are collected until flushBatches()
+	void dispatchEvent( const filemonitor::FileMonitorEvent &ev );
+	
+	//! Adds an event to the watch's pending batch, coalescing it with earlier ones
+	void collectBatchEvent( uint64_t wid, const ci::fs::path &path, EventType type );
+	
+	//! Hands every collected batch to its callback
+	void flushBatches();
+	
+	//! Appends an event to a stream watch's buffer, completing a waiting asyncNextEvents()
+	void pushStreamEvent( const std::shared_ptr<EventStream> &stream, const ci::fs::path &path, EventType type );
+	
+	//! Completes the waiters of streams that received events during this dispatch
+	void flushStreams();
+	
+	//! Moves up to maxEvents (at least 1) events out of stream's buffer, stream.mutex held
+	static void takeEvents( EventStream &stream, size_t maxEvents, std::vector<WatchEvent> &events );
+	
+	//! Completes waiter right away if events are buffered for wid, otherwise parks it
+	void waitEvents( uint64_t wid, size_t maxEvents, std::unique_ptr<EventWaiter> waiter );
+	
+	//! Aborts a waiting asyncNextEvents() of a stream watch that is being removed
+	void closeStream( uint64_t wid );
+	
+	//! Takes a RegisteredCallback from the free list, or allocates one if it's empty
+	RegisteredCallback *acquireCallback();
 	
+	//! Clears registered and returns it to the free list, called by the reclaimer
+	void releaseCallback( RegisteredCallback *registered );
+	
+	//! Looks up and runs the batch callback for wid, on whichever thread calls it
+	void dispatchBatch( uint64_t wid, const std::vector<WatchEvent> &events );
+	
+	//! Dispatches ready events until the update budget is spent
+	void dispatchReadyEvents();
+
 	// TODO migrate away from boost error_codes?
-	void fileEventHandler( const boost::system::error_code &ec,
-						   const filemonitor::FileMonitorEvent &ev );
+	void fileEventsHandler( const boost::system::error_code &ec,
+						    const std::vector<filemonitor::FileMonitorEvent> &events );
+	
+	//! Events delivered by the monitor and not dispatched yet, only touched by the polling thread
+	std::deque<filemonitor::FileMonitorEvent>		mReadyEvents;
+	std::chrono::microseconds						mUpdateBudget{ 0 };
+	//! batches collected by the current dispatch, keyed by watch
+	std::unordered_map<uint64_t, PendingBatch>		mPendingBatches;
+	//! watches in the order their first event was collected, batches are delivered in it
+	std::vector<uint64_t>							mPendingBatchOrder;
+	//! stream watches with a waiter that got events during the current dispatch
+	std::vector<std::shared_ptr<EventStream>>		mReadyStreams;
+	
+	//! runs mIoService while immediate dispatch is enabled
+	std::thread										mDispatchThread;
+	std::atomic<bool>								mImmediateDispatch{ false };
+	
+	//! Indexed by filemonitor::handleSlot( wid ), so lookups are plain array indexing
+	//! and a stale handle is rejected by comparing the stored generation
+	std::atomic<CallbackChunk*>						mCallbackChunks[sCallbackChunks];
+	//! declared ahead of the reclaimer, which releases into it when it's destroyed
+	std::mutex										mFreeCallbacksMutex;
+	std::vector<std::unique_ptr<RegisteredCallback>>	mFreeCallbacks;
+	//! Frees callbacks once no dispatching thread can still be running them
+	filemonitor::EpochReclaimer						mCallbackReclaimer;
+
+	//! Callback pool, each watch is pinned to a strand picked by its handle
+	std::unique_ptr<boost::asio::io_service>		mExecutorService;
+	std::unique_ptr<boost::asio::io_service::work>	mExecutorWork;
+	std::vector<std::thread>						mExecutorThreads;
+	std::vector<std::unique_ptr<boost::asio::io_service::strand>>	mExecutorStrands;
 	
-	std::map<uint64_t, WatchCallback> 				mRegisteredCallbacks;
+	//! WATCH_CONTENT_HASH watches, guarded by mContentMutex
+	std::mutex										mContentMutex;
+	std::unordered_map<uint64_t, std::shared_ptr<ContentHashes>>	mContentWatches;
+	std::atomic<size_t>								mContentWatchCount{ 0 };
+	//! hashing pool, started with the first content hashed watch
+	std::unique_ptr<boost::asio::io_service>		mHashService;
+	std::unique_ptr<boost::asio::io_service::work>	mHashWork;
+	std::vector<std::thread>						mHashThreads;
+	std::vector<std::unique_ptr<boost::asio::io_service::strand>>	mHashStrands;
+	//! hashed events posted back to mIoService and not run yet
+	std::atomic<size_t>								mContentHandlers{ 0 };
 
 	boost::asio::io_service 						mIoService;
+	//! only set on instances that own their backend
 	std::unique_ptr<filemonitor::FileMonitor> 		mFileMonitor;
+	//! this, or the instance whose monitor is shared
+	FileWatcher										*mBackend;
+	//! events forwarded from a shared backend, posted to mIoService and not run yet
+	std::atomic<size_t>								mForwardedHandlers{ 0 };
+	//! asyncNextEvents() completions that haven't run yet
+	std::atomic<size_t>								mWaiterHandlers{ 0 };
+	//! only touched by the polling thread
+	size_t											mServicePolls{ 0 };
+	std::mutex										mWakeMutex;
+	std::function<void ()>							mWake;
 	std::unique_ptr<boost::asio::io_service::work>	mAsioWork;
 };
 
@@ -97,7 +560,7 @@ class WatchedTarget : private ci::Noncopyable {
   public:
 	//! Creates a dead object (non watching target)
 	WatchedTarget()
-	: mWatchId( 0 ) { }
+	: mWatcher( nullptr ), mWatchId( 0 ) { }
 	
 	//! Valid objects will be de-registered from the FileMonitor service
 	~WatchedTarget();
@@ -110,6 +573,9 @@ class WatchedTarget : private ci::Noncopyable {
 	
 	uint64_t getId() const { return mWatchId; }
 	
+	//! Watcher the target was created on, nullptr for dead objects
+	FileWatcher *getWatcher() const { return mWatcher; }
+	
 	//! Check if we're watching a path
 	bool isPath() const { return ! mRegexMatch.empty(); }
 	//! Check if we're watching a specific file
@@ -121,45 +587,119 @@ class WatchedTarget : private ci::Noncopyable {
 	std::string getRegex() const { return mRegexMatch; }
 	
 	//! Updates the callback that will be triggered when a change is registered
-	void updateCallback( const WatchCallback &callback );
+	void updateCallback( WatchCallback callback );
+	
+	//! Switches the watch to batch delivery with callback
+	void updateBatchCallback( WatchBatchCallback callback );
+	
+	//! Waits for the next events of a watch created with addFileStream() / addPathStream(),
+	//! see FileWatcher::asyncNextEvents()
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_RESULT_TYPE( CompletionToken, WatchEventsSignature )
+	asyncNextEvents( size_t maxEvents, CompletionToken &&token )
+	{
+		return mWatcher->asyncNextEvents( mWatchId, maxEvents, std::forward<CompletionToken>( token ) );
+	}
+	
+	//! Takes the oldest queued event of a watch created with addFileChannel() /
+	//! addPathChannel(), returns false if there is none.  Call from one thread at a time.
+	bool tryPop( WatchEvent &event )
+	{
+		filemonitor::FileMonitorEvent ev;
+		if( ! mChannel || ! mChannel->tryPop( ev ) ) {
+			return false;
+		}
+		event = WatchEvent( ev.getPath(), ev.type );
+		return true;
+	}
+	
+	//! Writes every queued event to out, returns how many were taken
+	template <typename OutputIt>
+	size_t drain( OutputIt out )
+	{
+		size_t count = 0;
+		WatchEvent event;
+		while( tryPop( event ) ) {
+			*out++ = std::move( event );
+			++count;
+		}
+		return count;
+	}
+	
+	//! Events lost because the channel was full, the consumer should rescan if it grows
+	size_t getDroppedCount() const { return mChannel ? mChannel->dropped() : 0; }
 
 		
   protected:
 	//! Constructor for watching a file
-	WatchedTarget( uint64_t wid,
-				   const ci::fs::path &path,
-				   const WatchCallback &callback )
-	: mWatchId( wid ),
-	  mPath( path ),
-	  mCallback( callback )
+	WatchedTarget( FileWatcher *watcher,
+				   uint64_t wid,
+				   const ci::fs::path &path )
+	: mWatcher( watcher ),
+	  mWatchId( wid ),
+	  mPath( path )
 	{ }
 	
 	//! Constructor for watching a path
-	WatchedTarget( uint64_t wid,
+	WatchedTarget( FileWatcher *watcher,
+				   uint64_t wid,
 				   const ci::fs::path &path,
-				   const std::string &regexMatch,
-				   const WatchCallback &callback )
-	: mWatchId( wid ),
+				   const std::string &regexMatch )
+	: mWatcher( watcher ),
+	  mWatchId( wid ),
 	  mPath( path ),
-	  mCallback( callback ),
 	  mRegexMatch( regexMatch )
 	{ }
 	
+	FileWatcher		*mWatcher;
 	//! when utilized the ID will always be > 0
 	uint64_t 		mWatchId;
 	ci::fs::path 	mPath;
-	WatchCallback	mCallback;
 	std::string 	mRegexMatch;
+	//! set for channel watches, shared with the router
+	std::shared_ptr<filemonitor::EventChannel>	mChannel;
 		
 };
 	
+//! Scoped helper that batches all watch changes made during its lifetime
+class WatchBatch : private ci::Noncopyable {
+  public:
+	explicit WatchBatch( FileWatcher *watcher = FileWatcher::instance() )
+	: mWatcher( watcher )
+	{ mWatcher->beginBatch(); }
+	
+	~WatchBatch() { mWatcher->commitBatch(); }
+	
+  private:
+	FileWatcher		*mWatcher;
+};
+	
 template <typename KeyT>
 class WatchedTargetMap : public std::map<KeyT, WatchedTarget> {
 public:
 	
+	//! Tears every watch down in a single backend update
+	~WatchedTargetMap() { clear(); }
+	
 	void addWatch( KeyT key, WatchedTarget&& target ) {
 		this->insert( std::make_pair( key, std::move( target ) ) );
 	}
+	
+	//! Removes all watches, batched so each backend is only updated once
+	void clear() {
+		std::vector<FileWatcher*> watchers;
+		for( const auto &entry : *this ) {
+			FileWatcher *watcher = entry.second.getWatcher();
+			if( watcher && std::find( watchers.begin(), watchers.end(), watcher ) == watchers.end() ) {
+				watchers.push_back( watcher );
+				watcher->beginBatch();
+			}
+		}
+		std::map<KeyT, WatchedTarget>::clear();
+		for( FileWatcher *watcher : watchers ) {
+			watcher->commitBatch();
+		}
+	}
 
 };
 
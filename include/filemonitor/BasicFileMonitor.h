@@ -23,7 +23,12 @@
 
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
+
+#include "WatchFlags.h"
 
 namespace filemonitor {
 
@@ -37,14 +42,37 @@ class BasicFileMonitor
 	{
 	}
 	
-	uint64_t addFile( const boost::filesystem::path &file )
+	//! Pass WATCH_PENDING in flags to watch a file that does not exist yet
+	uint64_t addFile( const boost::filesystem::path &file, uint32_t flags = 0 )
 	{
-		return this->service.addFile( this->implementation, file );
+		return this->service.addFile( this->implementation, file, flags );
 	}
 	
 	uint64_t addPath( const boost::filesystem::path &path, const std::string &regexMatch )
 	{
-		return this->service.addPath( this->implementation, path, regexMatch );
+		return this->service.addPath( this->implementation, path, regexMatch, std::vector<std::string>(), WATCH_DEFAULT );
+	}
+	
+	//! Excluded subtrees ("dir/") and filename globs ("*.tmp") are dropped before routing
+	uint64_t addPath( const boost::filesystem::path &path,
+					  const std::string &regexMatch,
+					  const std::vector<std::string> &excludes,
+					  uint32_t flags = 0 )
+	{
+		return this->service.addPath( this->implementation, path, regexMatch, excludes, flags );
+	}
+	
+	//! Returns the id right away and arms the watch in the background.  The handler is
+	//! invoked through the io_service as void( uint64_t id, const error_code &ec ) once
+	//! the watch is live.  Takes the same flags as addPath().
+	template <typename Handler>
+	uint64_t addPathAsync( const boost::filesystem::path &path,
+						   const std::string &regexMatch,
+						   const std::vector<std::string> &excludes,
+						   uint32_t flags,
+						   Handler handler )
+	{
+		return this->service.addPathAsync( this->implementation, path, regexMatch, excludes, flags, handler );
 	}
 	
 	void remove( uint64_t id )
@@ -52,6 +80,57 @@ class BasicFileMonitor
 		this->service.remove( this->implementation, id );
 	}
 	
+	//! Number of watches currently registered with this monitor
+	size_t watchCount()
+	{
+		return this->service.watchCount( this->implementation );
+	}
+	
+	//! Caps the OS watch resources used by this monitor, 0 is unlimited.  Cold subtrees
+	//! over the budget fall back to polling rather than failing to register.
+	void setWatchBudget( size_t maxStreamRoots )
+	{
+		this->service.setWatchBudget( this->implementation, maxStreamRoots );
+	}
+	
+	//! Adds and removes made until commitBatch() are applied to the backend in one pass
+	void beginBatch()
+	{
+		this->service.beginBatch( this->implementation );
+	}
+	
+	void commitBatch()
+	{
+		this->service.commitBatch( this->implementation );
+	}
+	
+	//! Completion handlers waiting in the io_service, 0 means polling it would do nothing
+	size_t postedHandlers() const
+	{
+		return this->service.postedHandlers();
+	}
+	
+	//! Invoked from a background thread whenever a handler is posted to the io_service.
+	//! Shared by every monitor on the same io_service
+	void setWakeHandler( const std::function<void ()> &wake )
+	{
+		this->service.setWakeHandler( wake );
+	}
+	
+	//! How long the backend may hold changes back to coalesce them, in seconds.  0 delivers
+	//! every change as soon as the OS reports it
+	void setLatency( double seconds )
+	{
+		this->service.setLatency( this->implementation, seconds );
+	}
+	
+	//! Routes the events of watch id into channel, bypassing the io_service.  The channel
+	//! is detached when the watch is removed
+	void attachChannel( uint64_t id, const std::shared_ptr<EventChannel> &channel )
+	{
+		this->service.attachChannel( this->implementation, id, channel );
+	}
+	
 	FileMonitorEvent monitor()
 	{
 		boost::system::error_code ec;
@@ -71,6 +150,15 @@ class BasicFileMonitor
 	{
 		this->service.asyncMonitor( this->implementation, handler );
 	}
+	
+	//! Like asyncMonitor(), but the handler receives every queued event in one call as
+	//! void( const error_code &ec, const std::vector<FileMonitorEvent> &events ), so a
+	//! burst of changes costs a single hop to the io_service
+	template <typename Handler>
+	void asyncMonitorEvents( Handler handler )
+	{
+		this->service.asyncMonitorEvents( this->implementation, handler );
+	}
 };
 	
 } // namespace filemonitor
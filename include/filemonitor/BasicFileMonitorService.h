@@ -72,6 +72,13 @@ class BasicFileMonitorService
 	// TODO move to std
 	typedef boost::shared_ptr<FileMonitorImplementation> implementation_type;
 	
+	//! Bookkeeping for handlers posted to the owning io_service
+	struct PostState {
+		std::atomic<size_t>			handlers{0};
+		std::mutex					wakeMutex;
+		std::function<void ()>		wake;
+	};
+	
 	void construct( implementation_type &impl )
 	{
 		impl.reset( new FileMonitorImplementation() );
@@ -86,30 +93,67 @@ class BasicFileMonitorService
 		impl.reset();
 	}
 	
-	uint64_t addPath( implementation_type &impl, const boost::filesystem::path &path, const std::string& regexMatch )
+	uint64_t addPath( implementation_type &impl,
+					  const boost::filesystem::path &path,
+					  const std::string& regexMatch,
+					  const std::vector<std::string> &excludes,
+					  uint32_t flags )
 	{
-		if ( ! boost::filesystem::is_directory( path ) ) {
+		if ( ! ( flags & WATCH_PENDING ) && ! boost::filesystem::is_directory( path ) ) {
 			// TODO migrate to a different exception
 			throw std::invalid_argument("boost::asio::BasicFileMonitorService::addFile: \"" +
 										path.string() + "\" is not a valid file or directory entry");
 		}
 		
-		return impl->addPath( path, regexMatch );
+		// events carry absolute paths, and a pending watch walks up towards the root
+		return impl->addPath( boost::filesystem::absolute( path ), regexMatch, excludes, flags );
 	}
 	
-	uint64_t addFile( implementation_type &impl, const boost::filesystem::path &path )
+	template <typename Handler>
+	uint64_t addPathAsync( implementation_type &impl,
+						   const boost::filesystem::path &path,
+						   const std::string& regexMatch,
+						   const std::vector<std::string> &excludes,
+						   uint32_t flags,
+						   Handler handler )
 	{
-		if ( ! boost::filesystem::is_regular_file( path ) ) {
+		if ( ! ( flags & WATCH_PENDING ) && ! boost::filesystem::is_directory( path ) ) {
+			// TODO migrate to a different exception
+			throw std::invalid_argument("boost::asio::BasicFileMonitorService::addPathAsync: \"" +
+										path.string() + "\" is not a valid file or directory entry");
+		}
+		
+		// the arming thread is not the owning io_service, hand the completion over
+		boost::asio::io_service &ioService = this->get_io_service();
+		PostState &posted = mPosted;
+		return impl->addPathAsync( boost::filesystem::absolute( path ), regexMatch, excludes, flags,
+			[&ioService, &posted, handler]( uint64_t id, const boost::system::error_code &ec ) {
+				postCounted( ioService, posted, boost::asio::detail::bind_handler( handler, id, ec ) );
+			} );
+	}
+	
+	uint64_t addFile( implementation_type &impl, const boost::filesystem::path &path, uint32_t flags )
+	{
+		if ( flags & WATCH_PENDING ) {
+			// a pending target is validated once it appears
+			if ( boost::filesystem::exists( path ) && ! boost::filesystem::is_regular_file( path ) ) {
+				// TODO migrate to a different exception
+				throw std::invalid_argument("boost::asio::BasicFileMonitorService::addFile: \"" +
+											path.string() + "\" is not a valid file or directory entry");
+			}
+		}
+		else if ( ! boost::filesystem::is_regular_file( path ) ) {
 			// TODO migrate to a different exception
 			throw std::invalid_argument("boost::asio::BasicFileMonitorService::addFile: \"" +
 										path.string() + "\" is not a valid file or directory entry");
 		}
-		if ( boost::filesystem::is_symlink( path ) && boost::filesystem::read_symlink( path ) != path ) {
+		if ( ! ( flags & WATCH_FOLLOW_SYMLINKS )
+			 && boost::filesystem::is_symlink( path ) && boost::filesystem::read_symlink( path ) != path ) {
 			// TODO migrate to a different exception
 			throw std::invalid_argument("boost::asio::BasicFileMonitorService::addFile: \"" +
 										path.string() + "\" this path is a symlink and must be resolved");
 		}
-		return impl->addFile( path );
+		return impl->addFile( boost::filesystem::absolute( path ), flags );
 	}
 
 	void remove( implementation_type &impl, uint64_t id )
@@ -117,6 +161,52 @@ class BasicFileMonitorService
 		impl->remove( id );
 	}
 	
+	size_t watchCount( implementation_type &impl )
+	{
+		return impl->watchCount();
+	}
+	
+	void setWatchBudget( implementation_type &impl, size_t maxStreamRoots )
+	{
+		impl->setWatchBudget( maxStreamRoots );
+	}
+	
+	void beginBatch( implementation_type &impl )
+	{
+		impl->beginBatch();
+	}
+	
+	void commitBatch( implementation_type &impl )
+	{
+		impl->commitBatch();
+	}
+	
+	//! Completion handlers posted to the owning io_service that haven't run yet.  A
+	//! relaxed load is enough to skip polling when it's 0, a handler posted meanwhile is
+	//! picked up by the next poll.
+	size_t postedHandlers() const
+	{
+		return mPosted.handlers.load( std::memory_order_relaxed );
+	}
+	
+	//! Called from the monitor threads right after a completion handler was posted, lets
+	//! an external loop wake up and poll instead of waiting for its next iteration
+	void setWakeHandler( const std::function<void ()> &wake )
+	{
+		std::lock_guard<std::mutex> lock( mPosted.wakeMutex );
+		mPosted.wake = wake;
+	}
+	
+	void setLatency( implementation_type &impl, double seconds )
+	{
+		impl->setLatency( seconds );
+	}
+	
+	void attachChannel( implementation_type &impl, uint64_t id, const std::shared_ptr<EventChannel> &channel )
+	{
+		impl->attachChannel( id, channel );
+	}
+	
 	/**
 	 * Blocking event monitor.
 	 */
@@ -129,8 +219,9 @@ class BasicFileMonitorService
 	class MonitorOperation
 	{
 	public:
-		MonitorOperation( implementation_type &impl, boost::asio::io_service &ioService, Handler handler )
-		: mImpl( impl ), mIoService( ioService ), mWork( ioService ), mHandler( handler )
+		MonitorOperation( implementation_type &impl, boost::asio::io_service &ioService,
+						  PostState &posted, Handler handler )
+		: mImpl( impl ), mIoService( ioService ), mPosted( posted ), mWork( ioService ), mHandler( handler )
 		{
 		}
 		
@@ -140,18 +231,19 @@ class BasicFileMonitorService
 			if( impl ) {
 				boost::system::error_code ec;
 				FileMonitorEvent ev = impl->popFrontEvent( ec );
-				this->mIoService.post( boost::asio::detail::bind_handler( mHandler, ec, ev ) );
+				postCounted( this->mIoService, mPosted, boost::asio::detail::bind_handler( mHandler, ec, ev ) );
 			}
 			else {
-				this->mIoService.post( boost::asio::detail::bind_handler( mHandler,
-																		  boost::asio::error::operation_aborted,
-																		  FileMonitorEvent() ) );
+				postCounted( this->mIoService, mPosted, boost::asio::detail::bind_handler( mHandler,
+																						   boost::asio::error::operation_aborted,
+																						   FileMonitorEvent() ) );
 			}
 		}
 		
 	private:
 		boost::weak_ptr<FileMonitorImplementation> 	mImpl;
 		boost::asio::io_service 					&mIoService;
+		PostState									&mPosted;
 		boost::asio::io_service::work 				mWork;
 		Handler 									mHandler;
 	};
@@ -162,10 +254,86 @@ class BasicFileMonitorService
 	template <typename Handler>
 	void asyncMonitor( implementation_type &impl, Handler handler )
 	{
-		this->mAsyncMonitorIoService.post( MonitorOperation<Handler>( impl, this->get_io_service(), handler ) );
+		this->mAsyncMonitorIoService.post( MonitorOperation<Handler>( impl, this->get_io_service(), mPosted, handler ) );
+	}
+	
+	template <typename Handler>
+	class MonitorEventsOperation
+	{
+	public:
+		MonitorEventsOperation( implementation_type &impl, boost::asio::io_service &ioService,
+								PostState &posted, Handler handler )
+		: mImpl( impl ), mIoService( ioService ), mPosted( posted ), mWork( ioService ), mHandler( handler )
+		{
+		}
+		
+		void operator()() const
+		{
+			implementation_type impl = mImpl.lock();
+			std::vector<FileMonitorEvent> events;
+			if( impl ) {
+				boost::system::error_code ec;
+				impl->popFrontEvents( events, ec );
+				postCounted( this->mIoService, mPosted, boost::asio::detail::bind_handler( mHandler, ec, events ) );
+			}
+			else {
+				postCounted( this->mIoService, mPosted, boost::asio::detail::bind_handler( mHandler,
+																						   boost::asio::error::operation_aborted,
+																						   events ) );
+			}
+		}
+		
+	private:
+		boost::weak_ptr<FileMonitorImplementation> 	mImpl;
+		boost::asio::io_service 					&mIoService;
+		PostState									&mPosted;
+		boost::asio::io_service::work 				mWork;
+		Handler 									mHandler;
+	};
+	
+	/**
+	 * Non-blocking event monitor, delivering everything queued at once.
+	 */
+	template <typename Handler>
+	void asyncMonitorEvents( implementation_type &impl, Handler handler )
+	{
+		this->mAsyncMonitorIoService.post( MonitorEventsOperation<Handler>( impl, this->get_io_service(), mPosted, handler ) );
 	}
 	
   private:
+	//! Decrements the posted count when run, before calling the wrapped handler
+	template <typename Handler>
+	class CountedHandler
+	{
+	public:
+		CountedHandler( PostState &posted, Handler handler )
+		: mPosted( posted ), mHandler( handler )
+		{
+		}
+		
+		void operator()()
+		{
+			mPosted.handlers.fetch_sub( 1, std::memory_order_relaxed );
+			mHandler();
+		}
+		
+	private:
+		PostState				&mPosted;
+		Handler					mHandler;
+	};
+	
+	template <typename Handler>
+	static void postCounted( boost::asio::io_service &ioService, PostState &posted, Handler handler )
+	{
+		posted.handlers.fetch_add( 1, std::memory_order_relaxed );
+		ioService.post( CountedHandler<Handler>( posted, handler ) );
+		
+		std::lock_guard<std::mutex> lock( posted.wakeMutex );
+		if( posted.wake ) {
+			posted.wake();
+		}
+	}
+	
 	void shutdown_service()
 	{
 		//TODO need anything?
@@ -175,6 +343,7 @@ class BasicFileMonitorService
 	//! note: migrated from scoped_ptr.  remove comment if this works
 	std::unique_ptr<boost::asio::io_service::work> 		mAsyncMonitorWork;
 	std::thread 										mAsyncMonitorThread;
+	PostState											mPosted;
 };
 
 template <typename FileMonitorImplementation>
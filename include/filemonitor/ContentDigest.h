@@ -0,0 +1,54 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace filemonitor {
+
+//! What is known about a file's contents, used to tell real modifications from
+//! notifications that left the bytes alone
+struct ContentDigest {
+	uintmax_t	size = 0;
+	//! modification time in nanoseconds
+	int64_t		mtime = 0;
+	uint64_t	hash = 0;
+	//! wall clock time in nanoseconds when size and mtime were read
+	int64_t		checked = 0;
+	//! false for a baseline taken from stat alone, hash is meaningless then
+	bool		hashed = false;
+};
+
+//! Reads size and modification time of path, returns false if it can't be stat'ed
+bool statContent( const std::string &path, ContentDigest &digest );
+
+//! True if digest's mtime was already older than the coarsest file system time
+//! resolution when it was read, so a later write is bound to move the mtime.  Only
+//! then does an unchanged size and mtime prove the contents are unchanged
+bool isSettled( const ContentDigest &digest );
+
+//! Fills digest from the file at path, hashing its bytes through a read only mapping.
+//! Size, time and hash come from the same open file.  Returns false on failure
+bool hashContent( const std::string &path, ContentDigest &digest );
+
+} // namespace filemonitor
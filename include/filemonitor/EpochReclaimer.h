@@ -0,0 +1,171 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace filemonitor {
+
+//! Epoch based reclamation for data that readers reach without taking a lock.
+//! Readers wrap each access in a Guard, which announces the epoch it started in.
+//! Writers unlink an object first and then retire() it, it is reclaimed once every
+//! reader that could still see it has left its guard.  Entering and leaving a guard
+//! is lock-free, only retire() / collect() take a mutex.
+class EpochReclaimer
+{
+  public:
+	//! Upper bound on readers inside a guard at the same time, extra readers spin
+	static const size_t sMaxReaders = 64;
+	
+	EpochReclaimer()
+	: mEpoch( 1 )
+	{
+		for( auto &announced : mAnnounced ) {
+			announced.store( 0 );
+		}
+	}
+	
+	~EpochReclaimer()
+	{
+		// no readers can be left once the owner is gone, a reclaim may still retire more
+		while( ! mRetired.empty() ) {
+			Retired retired;
+			retired.swap( mRetired );
+			for( auto &entry : retired ) {
+				entry.second();
+			}
+		}
+	}
+	
+	EpochReclaimer( const EpochReclaimer & ) = delete;
+	EpochReclaimer &operator=( const EpochReclaimer & ) = delete;
+	
+	//! Keeps everything a reader loads while it's alive from being reclaimed
+	class Guard
+	{
+	  public:
+		explicit Guard( EpochReclaimer &reclaimer )
+		: mAnnounced( reclaimer.enter() )
+		{ }
+		
+		~Guard() { mAnnounced->store( 0 ); }
+		
+		Guard( const Guard & ) = delete;
+		Guard &operator=( const Guard & ) = delete;
+		
+	  private:
+		std::atomic<uint64_t>	*mAnnounced;
+	};
+	
+	//! Hands over an object that is no longer reachable, reclaim runs once it's safe
+	void retire( std::function<void ()> reclaim )
+	{
+		Retired reclaimable;
+		{
+			std::lock_guard<std::mutex> lock( mRetiredMutex );
+			mRetired.push_back( std::make_pair( mEpoch.fetch_add( 1 ), std::move( reclaim ) ) );
+			takeReclaimable( reclaimable );
+		}
+		reclaimAll( reclaimable );
+	}
+	
+	//! Reclaims whatever no reader can reach anymore
+	void collect()
+	{
+		Retired reclaimable;
+		{
+			std::lock_guard<std::mutex> lock( mRetiredMutex );
+			takeReclaimable( reclaimable );
+		}
+		reclaimAll( reclaimable );
+	}
+	
+	size_t pending() const
+	{
+		std::lock_guard<std::mutex> lock( mRetiredMutex );
+		return mRetired.size();
+	}
+	
+  private:
+	std::atomic<uint64_t> *enter()
+	{
+		// a stale epoch is conservative, it only holds back reclamation for longer
+		uint64_t epoch = mEpoch.load();
+		while( true ) {
+			for( auto &announced : mAnnounced ) {
+				uint64_t expected = 0;
+				if( announced.compare_exchange_strong( expected, epoch ) ) {
+					return &announced;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+	
+	//! epoch the object was retired in, and how to reclaim it
+	typedef std::vector<std::pair<uint64_t, std::function<void ()>>>	Retired;
+	
+	//! Moves everything no reader can reach into reclaimable, with mRetiredMutex held
+	void takeReclaimable( Retired &reclaimable )
+	{
+		// oldest epoch a reader is still inside, anything retired before it is unreachable
+		uint64_t oldest = mEpoch.load();
+		for( const auto &announced : mAnnounced ) {
+			uint64_t epoch = announced.load();
+			if( epoch != 0 && epoch < oldest ) {
+				oldest = epoch;
+			}
+		}
+		
+		auto keep = mRetired.begin();
+		for( auto it = mRetired.begin(); it != mRetired.end(); ++it ) {
+			if( it->first < oldest ) {
+				reclaimable.push_back( std::move( *it ) );
+			} else {
+				*keep++ = std::move( *it );
+			}
+		}
+		mRetired.erase( keep, mRetired.end() );
+	}
+	
+	//! Runs outside the lock, a reclaim is free to retire() or collect() again
+	static void reclaimAll( Retired &reclaimable )
+	{
+		for( auto &entry : reclaimable ) {
+			entry.second();
+		}
+	}
+	
+	std::atomic<uint64_t>		mEpoch;
+	std::atomic<uint64_t>		mAnnounced[sMaxReaders];
+	
+	mutable std::mutex			mRetiredMutex;
+	Retired						mRetired;
+};
+
+} // namespace filemonitor
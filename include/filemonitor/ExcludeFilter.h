@@ -0,0 +1,149 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+#include <vector>
+
+namespace filemonitor {
+
+//! Exclude patterns applied to path watches before any routing work happens.
+//! A pattern ending in '/' names a directory (e.g. ".git/" or "node_modules/")
+//! whose whole subtree is ignored wherever it appears below the watch root.
+//! Any other pattern is a filename glob supporting '*' and '?' (e.g. "*.tmp").
+class ExcludeFilter
+{
+  public:
+	ExcludeFilter()
+	{ }
+	
+	explicit ExcludeFilter( const std::vector<std::string> &patterns )
+	{
+		for( const auto &pattern : patterns ) {
+			if( pattern.empty() ) {
+				continue;
+			}
+			if( pattern.back() == '/' ) {
+				std::string dir = pattern.substr( 0, pattern.find_last_not_of( '/' ) + 1 );
+				if( ! dir.empty() ) {
+					mDirs.push_back( dir );
+				}
+			} else {
+				mGlobs.push_back( pattern );
+			}
+		}
+	}
+	
+	bool empty() const { return mDirs.empty() && mGlobs.empty(); }
+	
+	//! Returns true if the absolute path falls in an excluded subtree or file pattern below root.
+	//! Paths that are not below root are never excluded.
+	bool excludes( const std::string &path, const std::string &root ) const
+	{
+		if( empty() ) {
+			return false;
+		}
+		if( path.size() <= root.size() || path.compare( 0, root.size(), root ) != 0 ) {
+			return false;
+		}
+		// "/a/bc" shares a prefix with "/a/b" but isn't below it
+		if( ! root.empty() && root.back() != '/' && path[root.size()] != '/' ) {
+			return false;
+		}
+		
+		// walk the components after the root, last one is the filename
+		size_t pos = root.size();
+		while( pos < path.size() ) {
+			while( pos < path.size() && path[pos] == '/' ) {
+				++pos;
+			}
+			size_t end = path.find( '/', pos );
+			if( end == std::string::npos ) {
+				end = path.size();
+			}
+			if( end > pos ) {
+				for( const auto &dir : mDirs ) {
+					if( dir.size() == end - pos && path.compare( pos, end - pos, dir ) == 0 ) {
+						return true;
+					}
+				}
+				if( end == path.size() ) {
+					for( const auto &glob : mGlobs ) {
+						if( globMatch( glob.c_str(), path.c_str() + pos ) ) {
+							return true;
+						}
+					}
+				}
+			}
+			pos = end;
+		}
+		return false;
+	}
+	
+	//! Excluded directories that currently exist directly below root.  These are the
+	//! candidates that can be handed to the kernel so their events are never generated.
+	std::vector<boost::filesystem::path> subtreesBelow( const boost::filesystem::path &root ) const
+	{
+		std::vector<boost::filesystem::path> subtrees;
+		for( const auto &dir : mDirs ) {
+			boost::filesystem::path candidate = root / dir;
+			boost::system::error_code ec;
+			if( boost::filesystem::is_directory( candidate, ec ) ) {
+				subtrees.push_back( candidate );
+			}
+		}
+		return subtrees;
+	}
+	
+  private:
+	//! Simple '*' and '?' glob, matched against a null terminated filename
+	static bool globMatch( const char *glob, const char *name )
+	{
+		const char *starGlob = nullptr;
+		const char *starName = nullptr;
+		while( *name ) {
+			if( *glob == '*' ) {
+				starGlob = ++glob;
+				starName = name;
+			} else if( *glob == '?' || *glob == *name ) {
+				++glob;
+				++name;
+			} else if( starGlob ) {
+				glob = starGlob;
+				name = ++starName;
+			} else {
+				return false;
+			}
+		}
+		while( *glob == '*' ) {
+			++glob;
+		}
+		return *glob == '\0';
+	}
+	
+	std::vector<std::string>	mDirs;
+	std::vector<std::string>	mGlobs;
+};
+
+} // namespace filemonitor
@@ -21,9 +21,14 @@
 
 #pragma once
 
+#include <boost/filesystem.hpp>
+
+#include <memory>
 #include <string>
 #include <ostream>
 
+#include "SpscRing.h"
+
 namespace filemonitor {
 
 struct FileMonitorEvent
@@ -43,12 +48,29 @@ struct FileMonitorEvent
 	{ }
 	
 	FileMonitorEvent( const boost::filesystem::path &p, EventType t, uint64_t id )
-	: path( p ), type( t ), id( id )
+	: dir( std::make_shared<const boost::filesystem::path>( p.parent_path() ) ),
+	  name( p.filename().string() ), type( t ), id( id )
+	{ }
+	
+	//! Events are routed and queued as a shared directory node plus the entry name,
+	//! the full path is only built by getPath()
+	FileMonitorEvent( const std::shared_ptr<const boost::filesystem::path> &dir,
+					  const std::string &name,
+					  EventType t,
+					  uint64_t id )
+	: dir( dir ), name( name ), type( t ), id( id )
 	{ }
 	
-	boost::filesystem::path path;
-	EventType 				type;
-	uint64_t 				id;
+	//! Materializes the full path of the event
+	boost::filesystem::path getPath() const
+	{
+		return dir ? *dir / name : boost::filesystem::path( name );
+	}
+	
+	std::shared_ptr<const boost::filesystem::path>	dir;
+	std::string										name;
+	EventType 										type;
+	uint64_t 										id;
 };
 
 inline std::ostream& operator << ( std::ostream& os, const FileMonitorEvent &ev )
@@ -63,8 +85,11 @@ inline std::ostream& operator << ( std::ostream& os, const FileMonitorEvent &ev
 			case FileMonitorEvent::RENAMED_NEW: return "RENAMED_NEW";
 			default: return "UNKNOWN";
 		}
-	} ( ev.type ) << " " << ev.path;
+	} ( ev.type ) << " " << ev.getPath();
 	return os;
 }
 
+//! Per watch queue filled directly by the router, an alternative to the shared event queue
+typedef SpscRing<FileMonitorEvent> EventChannel;
+
 } // namespace filemonitor
\ No newline at end of file
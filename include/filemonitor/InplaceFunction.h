@@ -0,0 +1,164 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace filemonitor {
+
+template<typename Signature, size_t Capacity = 64>
+class InplaceFunction;
+
+//! Move-only callable that keeps its target in a fixed buffer inside the object, so
+//! storing or moving it never allocates.  Targets that don't fit are rejected at
+//! compile time rather than silently spilling to the heap.
+template<typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R ( Args... ), Capacity>
+{
+  public:
+	InplaceFunction()
+	: mOps( nullptr )
+	{ }
+	
+	InplaceFunction( std::nullptr_t )
+	: mOps( nullptr )
+	{ }
+	
+	template<typename F, typename = typename std::enable_if<
+		! std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+	InplaceFunction( F &&f )
+	: mOps( nullptr )
+	{
+		typedef typename std::decay<F>::type Target;
+		static_assert( sizeof( Target ) <= Capacity, "callable too large for InplaceFunction, capture less or by reference" );
+		static_assert( alignof( Target ) <= alignof( Storage ), "callable over-aligned for InplaceFunction" );
+		static_assert( std::is_move_constructible<Target>::value, "InplaceFunction needs a movable callable" );
+		
+		if( isEmpty( f, 0 ) ) {
+			return;
+		}
+		new( &mStorage ) Target( std::forward<F>( f ) );
+		mOps = &TargetOps<Target>::sOps;
+	}
+	
+	InplaceFunction( InplaceFunction &&other )
+	: mOps( other.mOps )
+	{
+		if( mOps ) {
+			mOps->move( &mStorage, &other.mStorage );
+			other.reset();
+		}
+	}
+	
+	InplaceFunction &operator=( InplaceFunction &&rhs )
+	{
+		if( this != &rhs ) {
+			reset();
+			if( rhs.mOps ) {
+				mOps = rhs.mOps;
+				mOps->move( &mStorage, &rhs.mStorage );
+				rhs.reset();
+			}
+		}
+		return *this;
+	}
+	
+	InplaceFunction &operator=( std::nullptr_t )
+	{
+		reset();
+		return *this;
+	}
+	
+	InplaceFunction( const InplaceFunction & ) = delete;
+	InplaceFunction &operator=( const InplaceFunction & ) = delete;
+	
+	~InplaceFunction() { reset(); }
+	
+	explicit operator bool() const { return mOps != nullptr; }
+	
+	R operator()( Args... args ) const
+	{
+		return mOps->invoke( &mStorage, std::forward<Args>( args )... );
+	}
+	
+  private:
+	typedef typename std::aligned_storage<Capacity, alignof( std::max_align_t )>::type Storage;
+	
+	//! Per target type operations, one static table each instead of a virtual base
+	struct Ops {
+		R		(*invoke)( const void *storage, Args&&... args );
+		void	(*move)( void *to, void *from );
+		void	(*destroy)( void *storage );
+	};
+	
+	template<typename Target>
+	struct TargetOps {
+		static R invoke( const void *storage, Args&&... args )
+		{
+			// callbacks are const for the caller, the same as std::function
+			return ( *const_cast<Target*>( static_cast<const Target*>( storage ) ) )( std::forward<Args>( args )... );
+		}
+		
+		static void move( void *to, void *from )
+		{
+			new( to ) Target( std::move( *static_cast<Target*>( from ) ) );
+		}
+		
+		static void destroy( void *storage )
+		{
+			static_cast<Target*>( storage )->~Target();
+		}
+		
+		static const Ops sOps;
+	};
+	
+	//! std::function and function pointers may be empty, keep them falsy here too
+	template<typename F>
+	static auto isEmpty( const F &f, int ) -> decltype( static_cast<bool>( ! f ) ) { return ! f; }
+	template<typename F>
+	static bool isEmpty( const F &, long ) { return false; }
+	
+	void reset()
+	{
+		if( mOps ) {
+			mOps->destroy( &mStorage );
+			mOps = nullptr;
+		}
+	}
+	
+	const Ops	*mOps;
+	Storage		mStorage;
+};
+
+template<typename R, typename... Args, size_t Capacity>
+template<typename Target>
+const typename InplaceFunction<R ( Args... ), Capacity>::Ops
+InplaceFunction<R ( Args... ), Capacity>::TargetOps<Target>::sOps = {
+	&TargetOps<Target>::invoke,
+	&TargetOps<Target>::move,
+	&TargetOps<Target>::destroy
+};
+
+} // namespace filemonitor
@@ -0,0 +1,99 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace filemonitor {
+
+//! Fast non-cryptographic hash used for path lookups.  Long inputs are consumed
+//! 32 bytes at a time in four independent lanes so the compiler can keep them in
+//! registers / vectorize, short inputs fall through to a single 8 byte lane.
+inline uint64_t hashBytes( const char *data, size_t len )
+{
+	static const uint64_t sPrime1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t sPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t sPrime3 = 0x165667B19E3779F9ULL;
+	
+	auto read64 = []( const char *p ) {
+		uint64_t v;
+		std::memcpy( &v, p, sizeof( v ) );
+		return v;
+	};
+	auto rotl = []( uint64_t x, int r ) {
+		return ( x << r ) | ( x >> ( 64 - r ) );
+	};
+	auto round = [&]( uint64_t acc, uint64_t input ) {
+		acc += input * sPrime2;
+		acc = rotl( acc, 31 );
+		return acc * sPrime1;
+	};
+	
+	const char *p = data;
+	const char *end = data + len;
+	uint64_t h = sPrime3 + (uint64_t)len * sPrime1;
+	
+	if( len >= 32 ) {
+		uint64_t v1 = sPrime1 + sPrime2;
+		uint64_t v2 = sPrime2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - sPrime1;
+		do {
+			v1 = round( v1, read64( p ) );
+			v2 = round( v2, read64( p + 8 ) );
+			v3 = round( v3, read64( p + 16 ) );
+			v4 = round( v4, read64( p + 24 ) );
+			p += 32;
+		} while( end - p >= 32 );
+		h ^= rotl( v1, 1 ) + rotl( v2, 7 ) + rotl( v3, 12 ) + rotl( v4, 18 );
+	}
+	
+	while( end - p >= 8 ) {
+		h = rotl( h ^ round( 0, read64( p ) ), 27 ) * sPrime1 + sPrime3;
+		p += 8;
+	}
+	
+	if( p < end ) {
+		uint64_t tail = 0;
+		std::memcpy( &tail, p, end - p );
+		h = rotl( h ^ round( 0, tail ), 27 ) * sPrime1 + sPrime3;
+	}
+	
+	// final avalanche
+	h ^= h >> 33;
+	h *= sPrime2;
+	h ^= h >> 29;
+	h *= sPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+//! Hash functor for path strings stored in the native format
+struct PathHash {
+	size_t operator()( const std::string &p ) const {
+		return static_cast<size_t>( hashBytes( p.data(), p.size() ) );
+	}
+};
+
+} // namespace filemonitor
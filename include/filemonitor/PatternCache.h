@@ -0,0 +1,96 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <regex>
+#include <string>
+#include <unordered_map>
+
+#include "PathHash.h"
+
+namespace filemonitor {
+
+//! Reference counted cache of compiled regular expressions keyed by pattern text
+//! and syntax flags.  Identical patterns registered on different watches share a
+//! single compiled matcher, which also lets routing evaluate each distinct pattern
+//! once per event.
+class PatternCache
+{
+  public:
+	typedef std::shared_ptr<const std::regex> PatternRef;
+	
+	//! Returns the compiled pattern, compiling it only on first use
+	PatternRef acquire( const std::string &pattern,
+						std::regex::flag_type flags = std::regex::ECMAScript )
+	{
+		std::string key = makeKey( pattern, flags );
+		auto it = mPatterns.find( key );
+		if( it == mPatterns.end() ) {
+			// compile before inserting so a bad pattern doesn't leave an entry behind
+			PatternRef regex = std::make_shared<const std::regex>( pattern, flags );
+			it = mPatterns.insert( std::make_pair( key, Entry( regex ) ) ).first;
+		}
+		it->second.refs += 1;
+		return it->second.regex;
+	}
+	
+	//! Drops a reference, the compiled pattern is freed with the last one
+	void release( const std::string &pattern,
+				  std::regex::flag_type flags = std::regex::ECMAScript )
+	{
+		auto it = mPatterns.find( makeKey( pattern, flags ) );
+		assert( it != mPatterns.end() );
+		
+		if( it->second.refs == 1 ) {
+			mPatterns.erase( it );
+		} else {
+			it->second.refs -= 1;
+		}
+	}
+	
+	//! Number of distinct compiled patterns
+	size_t size() const { return mPatterns.size(); }
+	
+  private:
+	static std::string makeKey( const std::string &pattern, std::regex::flag_type flags )
+	{
+		std::string key = std::to_string( static_cast<unsigned>( flags ) );
+		key += '\0';
+		key += pattern;
+		return key;
+	}
+	
+	struct Entry {
+		explicit Entry( const PatternRef &regex )
+		: regex( regex ), refs( 0 )
+		{ }
+		
+		PatternRef	regex;
+		uint32_t	refs;
+	};
+	
+	std::unordered_map<std::string, Entry, PathHash>	mPatterns;
+};
+
+} // namespace filemonitor
@@ -0,0 +1,177 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace filemonitor {
+
+//! Watch handles are 64 bit values laid out as [ generation:32 | index:31 | kind:1 ].
+//! The kind bit keeps the existing convention of odd ids for paths and even ids for
+//! files, the low 32 bits form a dense slot number shared by both kinds, and the
+//! generation detects handles whose slot has since been reused.  0 is never valid.
+enum HandleKind : uint32_t {
+	HANDLE_FILE = 0,
+	HANDLE_PATH = 1
+};
+
+inline HandleKind handleKind( uint64_t handle ) { return static_cast<HandleKind>( handle & 1 ); }
+
+inline uint32_t handleIndex( uint64_t handle ) { return static_cast<uint32_t>( handle ) >> 1; }
+
+inline uint32_t handleGeneration( uint64_t handle ) { return static_cast<uint32_t>( handle >> 32 ); }
+
+//! Dense index over both kinds, suitable for indexing per-watch arrays
+inline uint32_t handleSlot( uint64_t handle ) { return static_cast<uint32_t>( handle ); }
+
+inline uint64_t makeHandle( HandleKind kind, uint32_t index, uint32_t generation )
+{
+	return ( static_cast<uint64_t>( generation ) << 32 ) | ( static_cast<uint64_t>( index ) << 1 ) | kind;
+}
+
+//! Slot map handing out generational handles.  Values are stored densely so
+//! iteration stays cache friendly, slots map a handle to its value in O(1) and
+//! erasing moves the last value into the hole.  Pointers to values are not
+//! stable across insert / erase, hold on to handles instead.
+template <typename T, HandleKind Kind>
+class SlotMap
+{
+  public:
+	typedef typename std::vector<T>::iterator		iterator;
+	typedef typename std::vector<T>::const_iterator	const_iterator;
+	
+	uint64_t insert( T value )
+	{
+		uint32_t index;
+		if( mFreeHead != sNone ) {
+			index = mFreeHead;
+			mFreeHead = mSlots[index].valueIndex;
+		} else {
+			index = static_cast<uint32_t>( mSlots.size() );
+			assert( index < ( 1u << 31 ) );
+			mSlots.push_back( Slot() );
+		}
+		
+		Slot &slot = mSlots[index];
+		slot.valueIndex = static_cast<uint32_t>( mValues.size() );
+		mValues.push_back( std::move( value ) );
+		mValueSlots.push_back( index );
+		
+		return makeHandle( Kind, index, slot.generation );
+	}
+	
+	//! Returns nullptr for stale or foreign handles
+	T *get( uint64_t handle )
+	{
+		uint32_t valueIndex = lookup( handle );
+		return valueIndex == sNone ? nullptr : &mValues[valueIndex];
+	}
+	
+	const T *get( uint64_t handle ) const
+	{
+		uint32_t valueIndex = lookup( handle );
+		return valueIndex == sNone ? nullptr : &mValues[valueIndex];
+	}
+	
+	//! Returns false if the handle was stale
+	bool erase( uint64_t handle )
+	{
+		uint32_t valueIndex = lookup( handle );
+		if( valueIndex == sNone ) {
+			return false;
+		}
+		
+		// move the last value into the hole to keep values dense
+		uint32_t last = static_cast<uint32_t>( mValues.size() - 1 );
+		if( valueIndex != last ) {
+			mValues[valueIndex] = std::move( mValues[last] );
+			mValueSlots[valueIndex] = mValueSlots[last];
+			mSlots[mValueSlots[valueIndex]].valueIndex = valueIndex;
+		}
+		mValues.pop_back();
+		mValueSlots.pop_back();
+		
+		// bump the generation so outstanding handles go stale, never hand out 0
+		Slot &slot = mSlots[handleIndex( handle )];
+		if( ++slot.generation == 0 ) {
+			slot.generation = 1;
+		}
+		slot.valueIndex = mFreeHead;
+		mFreeHead = handleIndex( handle );
+		
+		return true;
+	}
+	
+	//! Handle of the value at a dense position, for use while iterating
+	uint64_t handleAt( size_t valueIndex ) const
+	{
+		uint32_t index = mValueSlots[valueIndex];
+		return makeHandle( Kind, index, mSlots[index].generation );
+	}
+	
+	size_t size() const { return mValues.size(); }
+	bool empty() const { return mValues.empty(); }
+	
+	iterator begin() { return mValues.begin(); }
+	iterator end() { return mValues.end(); }
+	const_iterator begin() const { return mValues.begin(); }
+	const_iterator end() const { return mValues.end(); }
+	
+  private:
+	static const uint32_t sNone = 0xFFFFFFFF;
+	
+	uint32_t lookup( uint64_t handle ) const
+	{
+		uint32_t index = handleIndex( handle );
+		if( handleKind( handle ) != Kind || index >= mSlots.size() ) {
+			return sNone;
+		}
+		const Slot &slot = mSlots[index];
+		if( slot.generation != handleGeneration( handle )
+			|| slot.valueIndex >= mValues.size()
+			|| mValueSlots[slot.valueIndex] != index ) {
+			return sNone;
+		}
+		return slot.valueIndex;
+	}
+	
+	struct Slot {
+		Slot()
+		: generation( 1 ), valueIndex( sNone )
+		{ }
+		
+		uint32_t	generation;
+		//! index into mValues when live, next free slot when not
+		uint32_t	valueIndex;
+	};
+	
+	std::vector<T>			mValues;
+	std::vector<uint32_t>	mValueSlots;
+	std::vector<Slot>		mSlots;
+	uint32_t				mFreeHead = sNone;
+};
+
+} // namespace filemonitor
@@ -0,0 +1,98 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace filemonitor {
+
+//! Bounded single producer / single consumer queue.  Push and pop are wait-free, the
+//! two ends only share the head and tail indices, each written by one side.  A full
+//! ring rejects new values and counts them, so a slow consumer can tell it missed changes.
+template <typename T>
+class SpscRing
+{
+  public:
+	//! capacity is rounded up to a power of two
+	explicit SpscRing( size_t capacity )
+	: mHead( 0 ), mTail( 0 ), mDropped( 0 )
+	{
+		size_t size = 2;
+		while( size < capacity ) {
+			size <<= 1;
+		}
+		mSlots.resize( size );
+		mMask = size - 1;
+	}
+	
+	SpscRing( const SpscRing & ) = delete;
+	SpscRing &operator=( const SpscRing & ) = delete;
+	
+	//! Producer side, returns false and counts a drop if the ring is full
+	bool tryPush( T &&value )
+	{
+		size_t tail = mTail.load( std::memory_order_relaxed );
+		if( tail - mHead.load( std::memory_order_acquire ) > mMask ) {
+			mDropped.fetch_add( 1, std::memory_order_relaxed );
+			return false;
+		}
+		mSlots[tail & mMask] = std::move( value );
+		mTail.store( tail + 1, std::memory_order_release );
+		return true;
+	}
+	
+	//! Consumer side, returns false if the ring is empty
+	bool tryPop( T &value )
+	{
+		size_t head = mHead.load( std::memory_order_relaxed );
+		if( head == mTail.load( std::memory_order_acquire ) ) {
+			return false;
+		}
+		value = std::move( mSlots[head & mMask] );
+		mHead.store( head + 1, std::memory_order_release );
+		return true;
+	}
+	
+	//! Approximate when called concurrently with either side
+	size_t size() const
+	{
+		return mTail.load( std::memory_order_acquire ) - mHead.load( std::memory_order_acquire );
+	}
+	
+	size_t capacity() const { return mMask + 1; }
+	
+	//! Values rejected because the ring was full
+	size_t dropped() const { return mDropped.load( std::memory_order_relaxed ); }
+	
+  private:
+	std::vector<T>			mSlots;
+	size_t					mMask;
+	//! on separate cache lines so the two sides don't invalidate each other
+	alignas( 64 ) std::atomic<size_t>	mHead;
+	alignas( 64 ) std::atomic<size_t>	mTail;
+	std::atomic<size_t>		mDropped;
+};
+
+} // namespace filemonitor
@@ -0,0 +1,104 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "SpscRing.h"
+
+//! Highest level that is compiled in, records above it cost nothing.  0 removes tracing
+//! entirely, define it (e.g. -DFILEMONITOR_TRACE_LEVEL=3) to observe a build.
+#ifndef FILEMONITOR_TRACE_LEVEL
+#define FILEMONITOR_TRACE_LEVEL 0
+#endif
+
+//! Records a trace point.  Arguments aren't evaluated for levels that are compiled out
+#define FILEMONITOR_TRACE( level, kind, a, b ) \
+	do { \
+		if( ( level ) <= FILEMONITOR_TRACE_LEVEL ) { \
+			filemonitor::Trace::record( ( level ), ( kind ), static_cast<uint64_t>( a ), static_cast<uint64_t>( b ) ); \
+		} \
+	} while( 0 )
+
+namespace filemonitor {
+
+enum TraceLevel : uint8_t {
+	TRACE_ERROR = 1,
+	TRACE_INFO = 2,
+	TRACE_DEBUG = 3
+};
+
+//! What a record describes, and what its two arguments hold
+enum TraceKind : uint16_t {
+	TRACE_MONITOR_ERROR,		//!< a: error value
+	TRACE_EVENTS_RECEIVED,		//!< a: events in the batch
+	TRACE_EVENT,				//!< a: watch id, b: event type
+	TRACE_WATCH_REMOVED			//!< a: watch id
+};
+
+//! Fixed size binary record, written to the drain file as is
+struct TraceRecord {
+	uint64_t	time;		//!< steady clock nanoseconds
+	uint64_t	a;
+	uint64_t	b;
+	uint32_t	thread;		//!< small sequential id, not the OS thread id
+	uint16_t	kind;
+	uint8_t		level;
+	uint8_t		reserved;
+};
+
+//! Tracing facility.  Each thread records into its own lock-free ring, registered the
+//! first time it traces.  A full ring drops records and counts them instead of blocking.
+//! Rings are emptied by collect(), or periodically into a file by startDrain().
+class Trace
+{
+  public:
+	//! Records per thread ring
+	static const size_t sRingCapacity = 4096;
+	
+	static void record( uint8_t level, uint16_t kind, uint64_t a, uint64_t b );
+	
+	//! Appends every buffered record to records, returns how many were added
+	static size_t collect( std::vector<TraceRecord> &records );
+	
+	//! Records lost to full rings so far
+	static size_t dropped();
+	
+	//! Appends buffered records to path every interval on a background thread, until
+	//! stopDrain().  Returns false if the file can't be opened.
+	static bool startDrain( const std::string &path,
+							std::chrono::milliseconds interval = std::chrono::milliseconds( 100 ) );
+	
+	//! Stops the drain thread after a final drain
+	static void stopDrain();
+	
+  private:
+	typedef SpscRing<TraceRecord> Ring;
+	
+	//! The calling thread's ring, created and registered on first use
+	static Ring &threadRing();
+};
+
+} // namespace filemonitor
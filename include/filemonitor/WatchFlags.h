@@ -0,0 +1,45 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace filemonitor {
+
+//! Options for individual watches, combined as a bitmask
+enum WatchFlags : uint32_t {
+	WATCH_DEFAULT	= 0,
+	//! The target may not exist yet.  The nearest existing ancestor is watched instead
+	//! and the watch moves down the path as directories appear, until the target exists
+	WATCH_PENDING	= 1 << 0,
+	//! Symlinks are resolved and watched at their canonical target, events are reported
+	//! under the linked path.  Watches sharing a target share one OS watch
+	WATCH_FOLLOW_SYMLINKS	= 1 << 1,
+	//! MODIFIED is only reported when the file's bytes changed, e.g. not after a touch
+	//! or a save without edits, the same goes for ADDED / RENAMED_NEW of a file whose
+	//! contents are known.  Files are hashed off the dispatching thread.  A file watch
+	//! hashes its file when added, a path watch only learns a file's contents from its
+	//! first event, which is therefore always reported
+	WATCH_CONTENT_HASH	= 1 << 2
+};
+
+} // namespace filemonitor
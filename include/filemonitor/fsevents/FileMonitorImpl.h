@@ -25,44 +25,169 @@
 #include <boost/filesystem.hpp>					// TODO migrate to standard C++ / cinder if possible
 
 #include <CoreServices/CoreServices.h>
+#include <atomic>
+#include <ctime>
+#include <functional>
 #include <thread>
 #include <regex>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "FileMonitorEvent.h"
+#include "ExcludeFilter.h"
+#include "PathHash.h"
+#include "PatternCache.h"
+#include "SlotMap.h"
+#include "WatchFlags.h"
 
 namespace filemonitor {
+
+//! Polling interval for roots that are over the watch budget
+static const uint16_t sPollingDelay = 200;
+//! Shortest polling interval, used when a low latency is requested
+static const uint16_t sMinPollingDelay = 20;
+//! Head start in milliseconds a streamed root keeps over polled ones, stops hot roots from swapping back and forth
+static const int64_t sBudgetHeatMargin = 2000;
 	
 class FileMonitorImpl :
 public std::enable_shared_from_this<FileMonitorImpl>
 {
   public:
+	//! Called from the arming thread once an asynchronously added watch is live
+	typedef std::function<void ( uint64_t id, const boost::system::error_code &ec )> ArmHandler;
+	
 	FileMonitorImpl()
-	: mRun(true), mWorkThread( &FileMonitorImpl::workThread, this ), mFsevents( nullptr )
+	: mRun(true), mWorkThread( &FileMonitorImpl::workThread, this ), mFsevents( nullptr ),
+	  mArmThread( &FileMonitorImpl::armThread, this )
 	{}
 	
 	~FileMonitorImpl();
 	
-	uint64_t addPath( const boost::filesystem::path &path, const std::string &regexMatch );
+	uint64_t addPath( const boost::filesystem::path &path,
+					  const std::string &regexMatch,
+					  const std::vector<std::string> &excludes,
+					  uint32_t flags = 0 );
+	
+	//! Registers the path watch and returns its id immediately.  The stream is rebuilt
+	//! on the arming thread, events from the rebuild window are replayed by fseventsd.
+	//! Symlinks of WATCH_FOLLOW_SYMLINKS watches are resolved there as well
+	uint64_t addPathAsync( const boost::filesystem::path &path,
+						   const std::string &regexMatch,
+						   const std::vector<std::string> &excludes,
+						   uint32_t flags,
+						   const ArmHandler &handler );
 	
-	uint64_t addFile( const boost::filesystem::path &file );
+	//! With WATCH_PENDING the file does not have to exist yet, the nearest existing
+	//! ancestor is watched until its directory appears
+	uint64_t addFile( const boost::filesystem::path &file, uint32_t flags = 0 );
 	
 	void remove( uint64_t id );
 	
+	//! Number of file and path watches currently registered
+	size_t watchCount();
+	
+	//! Routes the watch's events into channel instead of the shared event queue, until
+	//! the watch is removed.  Attach inside a batch with the add so no event slips past
+	void attachChannel( uint64_t id, const std::shared_ptr<EventChannel> &channel );
+	
+	//! Caps the number of roots handed to FSEvents, 0 means unlimited.  Once the plan
+	//! needs more roots the least recently active ones are polled instead, and they are
+	//! promoted back into the stream as budget frees up or they become hot.
+	void setWatchBudget( size_t maxStreamRoots );
+	
+	//! Seconds fseventsd may hold changes back to coalesce them, 1 by default.  0 delivers
+	//! changes as they happen.  Polled roots are rescanned at a matching rate.
+	void setLatency( double seconds );
+	
+	//! Stages adds and removes until the matching commitBatch(), batches can be nested.
+	//! Routing picks up the staged watches when the batch commits
+	void beginBatch();
+	
+	//! Applies everything staged since beginBatch() with a single stream rebuild
+	void commitBatch();
+	
 	void destroy();
 	
 	FileMonitorEvent popFrontEvent( boost::system::error_code &ec );
 	
-	void verifyEvent( const boost::filesystem::path &path, FileMonitorEvent::EventType type );
+	//! Blocks until events are queued and moves all of them into events
+	void popFrontEvents( std::vector<FileMonitorEvent> &events, boost::system::error_code &ec );
+	
+	//! Event id of changes that didn't come from a stream, they're never replayed history
+	static const FSEventStreamEventId sLiveEventId = ~FSEventStreamEventId( 0 );
+	
+	//! Routes a raw event path against the published routing table, without locking.
+	//! Lookups work on the string directly, a path object is only constructed for events
+	//! that match a watch.  Events older than a watch's registration are not routed to it
+	void verifyEvent( const std::string &path, FileMonitorEvent::EventType type,
+					  FSEventStreamEventId eventId = sLiveEventId );
 	
 	void pushBackEvent( const FileMonitorEvent &ev );
 	
   private:
 	
+	//! Per thread buffers used while routing so lookups don't allocate
+	struct RouteScratch {
+		std::string		dir;
+		std::string		name;
+	};
+	
+	//! Routes an event path to every matching watch
+	void routeEvent( const std::string &path, FileMonitorEvent::EventType type,
+					 FSEventStreamEventId eventId, RouteScratch &scratch );
+	
+	//! Publishes a routing table with whatever changed in the registries since the last
+	//! one, see mDirtyDirs.  Expects mPathsMutex
+	void publishRoutes();
+	
 	void startFsevents();
 	
+	//! Stamps a new registration with the current event id and remembers it until a
+	//! stream covers it.  Expects mPathsMutex
+	FSEventStreamEventId registrationId();
+	
 	void stopFsevents();
 	
+	//! Rebuilds the stream, or marks it dirty if a batch is open.  Expects mPathsMutex
+	void restartFsevents();
+	
+	//! Minimal set of directories covering every target.  Targets nested below another
+	//! target reuse its (recursive) watch instead of adding their own stream path
+	std::vector<std::string> planStreamRoots() const;
+	
+	//! Moves the coldest roots out of the plan once it exceeds the watch budget and
+	//! returns them, they are polled instead.  Expects mPathsMutex
+	std::vector<std::string> applyWatchBudget( std::vector<std::string> &roots );
+	
+	//! Records activity on a watch, used to rank roots against the watch budget
+	void touch( std::atomic<int64_t> &heat );
+	
+	//! Stat of a polled entry
+	struct PollStat {
+		std::time_t		mtime = 0;
+		uintmax_t		size = 0;
+	};
+	typedef std::unordered_map<std::string, PollStat, PathHash> PollSnapshot;
+	
+	//! Interval between scans of the polled roots, follows the stream latency
+	std::chrono::milliseconds pollingDelay() const;
+	
+	//! Rescans the polled roots and routes differences, returns true if anything changed.
+	//! Baselines taken at demotion replace the previous snapshot of their root
+	bool pollRoots( const std::vector<std::string> &roots,
+					const std::vector<boost::filesystem::path> &exclusions );
+	
+	//! Walks the roots waiting to be demoted with the lock released, then rebuilds the
+	//! stream without them.  Runs on the arming thread, expects mPathsMutex
+	void takeBaselines( std::unique_lock<std::mutex> &lock );
+	
+	void scanRoot( const std::string &root,
+				   const std::vector<boost::filesystem::path> &exclusions,
+				   PollSnapshot &snapshot );
+	
+	//! Excluded subtrees that are safe to hand to FSEvents, i.e. no other watch needs them
+	std::vector<boost::filesystem::path> kernelExclusions() const;
+	
 	static void fseventsCallback( ConstFSEventStreamRef streamRef,
 								  void *clientCallBackInfo,
 								  size_t numEvents,
@@ -76,125 +201,249 @@ public std::enable_shared_from_this<FileMonitorImpl>
 	
 	void stopWorkThread();
 	
-	//! Templated to make it easier to swap out map types
-	//! takes the ID and returns the path that was associated / removed
-	template<typename mapType>
-	boost::filesystem::path removeEntry( uint64_t id, mapType &idMap )
-	{
-		boost::filesystem::path path;
-		
-		auto iter = idMap.find( id );
-		assert( iter != idMap.end() );
-
-		path = iter->second.path;
-		// Removes the entry based on the ID
-		idMap.erase( iter );
-		
-		return path;
-	}
+	//! Rebuilds the stream for asynchronous registrations, coalescing queued requests
+	void armThread();
+	
+	//! Registers a path entry, expects mPathsMutex
+	uint64_t insertPathEntry( const boost::filesystem::path &path,
+							  const std::string &regexMatch,
+							  const std::vector<std::string> &excludes,
+							  uint32_t flags );
 	
-	//! Templated to make it easier to swap out map types
+	//! Moves pending watches down to the deepest existing directory of their target and
+	//! settles the ones whose target exists.  Expects mPathsMutex
+	void advancePending();
+	
+	//! Crawls the symlinks of asynchronously added watches with the lock released, then
+	//! routes and targets the watches that are still registered.  Expects mPathsMutex
+	void resolvePendingAliases( std::unique_lock<std::mutex> &lock );
+	
+	//! Removes a file entry from the owning and per-directory lookup tables
 	//! takes the ID and returns the path that was associated / removed
-	template<typename mapType, typename mmapType>
-	boost::filesystem::path removeEntry( uint64_t id, mapType &idMap, mmapType &pathMmap )
-	{
-		boost::filesystem::path path;
-		
-		auto iter = idMap.find( id );
-		assert( iter != idMap.end() );
-		
-		auto range = pathMmap.equal_range( iter->second.path );
-		assert( range.first != pathMmap.end() );
-		
-		auto rangeIter = range.first;
-		while( rangeIter != range.second ) {
-			// check id values for match
-			if( rangeIter->second->entryID == iter->second.entryID ) {
-				break;
-			}
-			++rangeIter;
-		}
-		assert( rangeIter != range.second );
-		
-		path = iter->second.path;
-		// Removes the entry based on the ID
-		idMap.erase( iter );
-		// Removes the path that was based on path and ID
-		pathMmap.erase( rangeIter );
-		
-		assert( mFilesMmap.size() == mFiles.size() );
-		
-		return path;
-	}
+	boost::filesystem::path removeFileEntry( uint64_t id );
 	
 	void incrementTarget( const boost::filesystem::path &path );
 
 	void decrementTarget( const boost::filesystem::path &path );
 	
+	//! Last activity of a watch in steady clock milliseconds, shared by the entry and its
+	//! routes so routing can record it without a lock
+	typedef std::shared_ptr<std::atomic<int64_t>> Heat;
+	
 	class PathEntry
 	{
 	public:
 		
 		PathEntry( const boost::filesystem::path &path,
-				   const std::string &regexMatch,
-				   uint64_t entryID )
-		: path( path ), regexMatch( regexMatch ), entryID( entryID )
+				   const std::string &pattern,
+				   const PatternCache::PatternRef &regexMatch,
+				   const std::vector<std::string> &excludes )
+		: path( path ), anchor( path ), pattern( pattern ), regexMatch( regexMatch ), excludes( excludes )
 		{}
 		
-		uint64_t				entryID;
-		boost::filesystem::path path;
-		std::regex 				regexMatch;
+		boost::filesystem::path 	path;
+		//! directory handed to fsevents, an ancestor of path while the watch is pending
+		boost::filesystem::path 	anchor;
+		//! canonical directory to logical prefix, only set when following symlinks.  The
+		//! first alias is the root itself, the rest are symlinked directories below it
+		std::vector<std::pair<std::string, std::string>>	aliases;
+		//! stream event id when the watch was added, older replayed events predate it
+		FSEventStreamEventId		sinceId = 0;
+		std::string					pattern;
+		//! shared with every other watch using the same pattern
+		PatternCache::PatternRef	regexMatch;
+		ExcludeFilter				excludes;
+		Heat						heat = std::make_shared<std::atomic<int64_t>>( 0 );
 	};
 	
 	class FileEntry
 	{
 	public:
 		
-		FileEntry( const boost::filesystem::path &path,
-				   uint64_t entryID )
-		: path( path ), entryID( entryID )
+		explicit FileEntry( const boost::filesystem::path &path )
+		: path( path ), anchor( path.parent_path() )
 		{ }
 		
-		uint64_t				entryID;
 		boost::filesystem::path path;
+		//! directory handed to fsevents, an ancestor of the parent while the watch is pending
+		boost::filesystem::path anchor;
+		//! path the watch was created with when it was a symlink, events are reported here
+		std::shared_ptr<const boost::filesystem::path>	logicalDir;
+		std::string										logicalName;
+		//! stream event id when the watch was added
+		FSEventStreamEventId							sinceId = 0;
+		Heat											heat = std::make_shared<std::atomic<int64_t>>( 0 );
 	};
 	
-	std::mutex 								mPathsMutex;
+	//! Directory node for exact file routing.  Events are matched by looking up the
+	//! directory and then the entry name, and the shared directory path is handed
+	//! to events so it doesn't have to be rebuilt for each one
+	class WatchedDir
+	{
+	public:
+		
+		explicit WatchedDir( const boost::filesystem::path &dir )
+		: dir( std::make_shared<const boost::filesystem::path>( dir ) )
+		{ }
+		
+		std::shared_ptr<const boost::filesystem::path>	dir;
+		
+		//! Multimap to support multiple watches on a single file, filename to handle
+		std::unordered_multimap<std::string, uint64_t, PathHash>	files;
+	};
 	
-	// ids, always > 0
-	uint64_t 								mNextFileId{2};
-	uint64_t								mNextPathId{1};
+	//! Hooks a path entry into the pattern groups used for routing
+	void attachPattern( uint64_t id, const PathEntry &entry );
 	
-	// TODO explore the use of hashmaps
+	//! Unhooks a path entry and releases its compiled pattern
+	void detachPattern( uint64_t id, const PathEntry &entry );
 	
-	//! Owns entries data
-	std::unordered_map<uint64_t, PathEntry> mPaths;
-	std::unordered_map<uint64_t, FileEntry> mFiles;
-
-	// references entries
-	struct pathHash {
-		size_t operator()( const boost::filesystem::path &p ) const {
-
-			return std::hash<std::string>()( p.string() );
-			
-			// TODO resolve fs::hash_value once namespace has been converted
-			//return boost::filesystem::hash_value( p );
+	//! Immutable snapshot of everything routing needs.  Registration builds a new table
+	//! and swaps it in, event threads keep whichever table they loaded until they're done
+	//! with it, so entries can be removed while an event is being routed.  A new table
+	//! shares every directory shard, pattern group and channel map that didn't change
+	//! with the previous one, so a single add or remove copies a fraction of it.
+	class RoutingTable
+	{
+	public:
+		
+		struct FileRoute {
+			uint64_t										id;
+			//! set when watched through a symlink
+			std::shared_ptr<const boost::filesystem::path>	logicalDir;
+			std::string										logicalName;
+			FSEventStreamEventId							sinceId;
+			Heat											heat;
+		};
+		
+		struct DirRoute {
+			std::shared_ptr<const boost::filesystem::path>	dir;
+			std::unordered_multimap<std::string, FileRoute, PathHash>	files;
+		};
+		
+		struct PathRoute {
+			uint64_t			id;
+			std::string			root;
+			ExcludeFilter		excludes;
+			std::vector<std::pair<std::string, std::string>>	aliases;
+			FSEventStreamEventId	sinceId;
+			Heat					heat;
+		};
+		
+		typedef std::unordered_map<std::string, std::shared_ptr<const DirRoute>, PathHash>	DirShard;
+		typedef std::vector<std::pair<PatternCache::PatternRef, PathRoute>>				AliasedRoutes;
+		typedef std::unordered_map<uint64_t, std::shared_ptr<EventChannel>>				Channels;
+		
+		static const size_t sDirShards = 256;
+		
+		//! top bits of the hash, the shard maps bucket by the low ones
+		static size_t dirShard( const std::string &dir ) { return static_cast<size_t>( hashBytes( dir.data(), dir.size() ) >> 56 ); }
+		
+		const DirRoute *findDir( const std::string &dir ) const
+		{
+			const std::shared_ptr<const DirShard> &shard = dirs[dirShard( dir )];
+			if( ! shard ) {
+				return nullptr;
+			}
+			auto it = shard->find( dir );
+			return it != shard->end() ? it->second.get() : nullptr;
 		}
+		
+		//! null for shards without a watched directory
+		std::shared_ptr<const DirShard>	dirs[sDirShards];
+		//! one entry per distinct regex, the ref keeps it alive past the last release()
+		std::vector<std::pair<PatternCache::PatternRef, std::shared_ptr<const std::vector<PathRoute>>>>	groups;
+		std::shared_ptr<const AliasedRoutes>	aliased;
+		//! watches consumed through a channel
+		std::shared_ptr<const Channels>		channels;
 	};
 	
+	//! Routes an event below one of a symlink following watch's canonical roots
+	void routeAliased( const std::shared_ptr<const RoutingTable> &routes,
+					   const std::string &path, FileMonitorEvent::EventType type, FSEventStreamEventId eventId,
+					   const RoutingTable::PathRoute &route, const std::regex &regex );
+	
+	//! Hands a routed event to its watch's channel, or to the shared queue if it has none
+	void deliverEvent( const std::shared_ptr<const RoutingTable> &routes, FileMonitorEvent &&ev );
+	
+	std::mutex 								mPathsMutex;
+	
+	//! open beginBatch() calls, stream rebuilds are deferred while > 0
+	uint32_t								mBatchDepth{0};
+	bool									mStreamDirty{false};
+	//! set by setLatency(), the next rebuild replaces the stream even if its roots match
+	bool									mLatencyDirty{false};
+	//! routing changed without the stream, e.g. a channel attached during a batch
+	bool									mRoutesDirty{false};
+	
+	//! what changed since the last publishRoutes(), everything else is shared with mRoutes
+	std::unordered_set<std::string, PathHash>	mDirtyDirs;
+	std::unordered_set<const std::regex*>	mDirtyPatterns;
+	bool									mAliasedDirty{false};
+	bool									mChannelsDirty{false};
+	
+	//! Owns entries data, keyed by generational handles (odd for paths, even for files)
+	SlotMap<PathEntry, HANDLE_PATH>			mPaths;
+	SlotMap<FileEntry, HANDLE_FILE>			mFiles;
+	
+	//! Compiled regexes shared between path entries
+	PatternCache							mPatternCache;
+	
+	//! Path entry handles grouped by their shared compiled pattern so routing runs
+	//! each distinct regex at most once per event
+	std::unordered_map<const std::regex*, std::vector<uint64_t>>	mPatternGroups;
+	
+	//! Symlink following path entries, their regex runs against the logical path so
+	//! they can't share a group match
+	std::vector<uint64_t>					mAliasedPaths;
+	
+	//! Channels attached to watches, guarded by mPathsMutex
+	std::unordered_map<uint64_t, std::shared_ptr<EventChannel>>	mChannels;
+	//! the fsevents thread and the poller both route, this makes them one producer per channel
+	std::mutex								mChannelPushMutex;
+
 	// TODO explore maps vs sets performance
 	
-	//! Used for quick lookup of file specific activity via a path
-	//! Multimap to support multiple watches on a single file
-	//! References entries data
-	std::unordered_multimap<boost::filesystem::path, FileEntry*, pathHash>	mFilesMmap;
+	//! Used for quick lookup of file specific activity via (directory, name)
+	std::unordered_map<std::string, WatchedDir, PathHash>		mWatchedDirs;
+	
+	//! Current routing table, read with std::atomic_load and replaced with std::atomic_store.
+	//! Readers never wait for mPathsMutex, but libc++ implements those two with a global
+	//! pool of spin locks held just for the pointer copy, so they aren't lock-free
+	std::shared_ptr<const RoutingTable>		mRoutes;
 	
 	//! Used to keep track of all watched targets, both file and paths
 	//! This is used for creating the watch list as it contains both files and paths
-	std::unordered_map<boost::filesystem::path, uint32_t, pathHash>			mAllTargetsMap;
+	std::unordered_map<std::string, uint32_t, PathHash>			mAllTargetsMap;
+	
+	//! Reused by the fsevents callback so raw event paths can be looked up without allocating
+	std::string								mScratchPath;
+	RouteScratch							mRouteScratch;
+	
+	//! max stream roots, 0 for unlimited
+	std::atomic<size_t>						mWatchBudget{0};
+	//! roots over budget, polled by the arming thread.  Guarded by mPathsMutex
+	std::vector<std::string>				mPolledRoots;
+	//! roots over budget that stay in the stream until their baseline is taken, and the
+	//! ones whose baseline is ready for the next rebuild.  Guarded by mPathsMutex
+	std::vector<std::string>				mDemotingRoots;
+	std::unordered_set<std::string, PathHash>	mBaselinedRoots;
+	//! only touched by the arming thread
+	std::unordered_map<std::string, PollSnapshot>		mPollSnapshots;
+	std::unordered_map<std::string, PollSnapshot>		mPollBaselines;
+	
+	//! asynchronous symlink watches waiting for the arming thread to resolve their links,
+	//! neither routed nor targeted yet.  Guarded by mPathsMutex
+	std::vector<uint64_t>					mUnresolvedIds;
+	//! watches whose target directory doesn't exist yet, guarded by mPathsMutex
+	std::vector<uint64_t>					mPendingIds;
+	std::atomic<size_t>						mPendingCount{0};
+	//! set by routing when something was created while watches are pending
+	std::atomic<bool>						mAdvanceRequested{false};
+	RouteScratch							mPollScratch;
 	
 	bool 									mRun{false};
-	CFRunLoopRef 							mRunloop;
+	CFRunLoopRef 							mRunloop{nullptr};
 	std::mutex 								mRunloopMutex;
 	std::condition_variable 				mRunloopCond;
 	
@@ -202,9 +451,26 @@ public std::enable_shared_from_this<FileMonitorImpl>
 	std::thread 							mWorkThread;
 	
 	FSEventStreamRef 						mFsevents;
+	//! roots and exclusions the running stream was created with
+	std::vector<std::string>				mStreamRoots;
+	std::vector<boost::filesystem::path>	mStreamExclusions;
+	//! latency the stream is created with, guarded by mPathsMutex
+	CFTimeInterval							mLatency{1.0};
+	//! last event the previous stream delivered, the next stream resumes from here.
+	//! 0 once no stream is running, nothing is left to resume then
+	FSEventStreamEventId					mResumeEventId{0};
+	//! oldest registration no running stream covers yet, 0 if there is none
+	FSEventStreamEventId					mUnstreamedSinceId{0};
 	std::mutex 								mEventsMutex;
 	std::condition_variable 				mEventsCond;
 	std::deque<FileMonitorEvent> 			mEvents;
+	
+	//! asynchronous registrations waiting for the stream, guarded by mPathsMutex
+	std::vector<std::pair<uint64_t, ArmHandler>>	mArmQueue;
+	std::condition_variable 				mArmCond;
+	bool									mArmRun{true};
+	//! last member, it runs against everything above
+	std::thread 							mArmThread;
 };
 	
 } // filemonitor namespace
@@ -20,6 +20,9 @@
  */
 
 #include "FileWatcher.h"
+#include "Trace.h"
+
+#include <stdexcept>
 
 #include "cinder/app/App.h"
 
@@ -33,7 +36,12 @@ namespace filewatcher {
 // MARK: - FileWatcher
 // ----------------------------------------------------------------------------------------------------
 FileWatcher::FileWatcher()
+: mBackend( this )
 {
+	for( auto &chunk : mCallbackChunks ) {
+		chunk.store( nullptr );
+	}
+	
 	// TODO move this into cinder's asio
 	
 	// setup our filemonitor asio service and link it to the internal cinder io_service
@@ -42,7 +50,41 @@ FileWatcher::FileWatcher()
 	mAsioWork = auto_ptr<boost::asio::io_service::work>( new boost::asio::io_service::work( mIoService ) );
 	
 	// prime the first handler
-	mFileMonitor->asyncMonitor( std::bind( &FileWatcher::fileEventHandler, this, std::placeholders::_1, std::placeholders::_2 ) );
+	mFileMonitor->asyncMonitorEvents( std::bind( &FileWatcher::fileEventsHandler, this, std::placeholders::_1, std::placeholders::_2 ) );
+}
+
+FileWatcher::FileWatcher( FileWatcher *backend )
+: mBackend( backend->mBackend )
+{
+	for( auto &chunk : mCallbackChunks ) {
+		chunk.store( nullptr );
+	}
+	
+	// no monitor of our own, the backend forwards events into mIoService
+	mAsioWork = auto_ptr<boost::asio::io_service::work>( new boost::asio::io_service::work( mIoService ) );
+}
+	
+FileWatcher::~FileWatcher()
+{
+	if( mImmediateDispatch ) {
+		mIoService.stop();
+		mDispatchThread.join();
+	}
+	mAsioWork.reset();
+	stopContentHashing();
+	stopExecutor();
+	
+	// retired callbacks are released by the reclaimer, live ones are owned by their slot
+	for( auto &chunk : mCallbackChunks ) {
+		CallbackChunk *callbacks = chunk.load();
+		if( ! callbacks ) {
+			continue;
+		}
+		for( auto &slot : callbacks->slots ) {
+			delete slot.registered.load();
+		}
+		delete callbacks;
+	}
 }
 	
 FileWatcher *FileWatcher::instance()
@@ -58,82 +100,973 @@ void FileWatcher::registerUpdate()
 
 void FileWatcher::poll()
 {
+	if( mImmediateDispatch ) {
+		return;
+	}
+	++mServicePolls;
 	mIoService.poll();
+	dispatchReadyEvents();
 }
 
 
 WatchedTarget FileWatcher::watchFile( const fs::path &file,
-									  const WatchCallback &callback )
+									  WatchCallback callback,
+									  uint32_t flags )
 {
-	uint64_t wid = instance()->mFileMonitor->addFile( file );
-	WatchedTarget obj = WatchedTarget( wid , file, callback );
-	// register the callback
-	auto it = instance()->mRegisteredCallbacks.insert( std::pair<uint64_t, WatchCallback>( wid, obj.mCallback ) );
-	
-	// double check item didn't exist, should be impossible
-	CI_ASSERT( it.second );
-	return obj;
+	return instance()->addFileWatch( file, std::move( callback ), flags );
 }
 	
 WatchedTarget FileWatcher::watchPath( const fs::path &path,
 									  const std::string &regex,
-									  const WatchCallback &callback )
+									  WatchCallback callback,
+									  const std::vector<std::string> &excludes,
+									  uint32_t flags )
+{
+	return instance()->addPathWatch( path, regex, std::move( callback ), excludes, flags );
+}
+
+WatchedTarget FileWatcher::watchPathAsync( const fs::path &path,
+										   const std::string &regex,
+										   WatchCallback callback,
+										   const WatchArmedCallback &armed,
+										   const std::vector<std::string> &excludes,
+										   uint32_t flags )
+{
+	return instance()->addPathWatchAsync( path, regex, std::move( callback ), armed, excludes, flags );
+}
+
+WatchedTarget FileWatcher::addFileWatch( const fs::path &file,
+										 WatchCallback callback,
+										 uint32_t flags )
+{
+	// the baseline predates the watch, a write racing the add can't end up in it
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( file, flags );
+	uint64_t wid = monitor().addFile( file, flags );
+	// register the callback, the registry is its only owner
+	RegisteredCallback *registered = acquireCallback();
+	registered->callback = std::move( callback );
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , file );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addPathWatch( const fs::path &path,
+										 const std::string &regex,
+										 WatchCallback callback,
+										 const std::vector<std::string> &excludes,
+										 uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( fs::path(), flags );
+	uint64_t wid = monitor().addPath( path, regex, excludes, flags );
+	RegisteredCallback *registered = acquireCallback();
+	registered->callback = std::move( callback );
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , path, regex );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addPathWatchAsync( const fs::path &path,
+											  const std::string &regex,
+											  WatchCallback callback,
+											  const WatchArmedCallback &armed,
+											  const std::vector<std::string> &excludes,
+											  uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( fs::path(), flags );
+	// the completion is posted to the backend's io_service, it runs when that is polled
+	uint64_t wid = monitor().addPathAsync( path, regex, excludes, flags,
+		[path, armed]( uint64_t, const boost::system::error_code &ec ) {
+			if( armed ) {
+				armed( path, ec );
+			}
+		} );
+	RegisteredCallback *registered = acquireCallback();
+	registered->callback = std::move( callback );
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , path, regex );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::watchFileBatch( const fs::path &file,
+										   WatchBatchCallback callback,
+										   uint32_t flags )
 {
-	uint64_t wid = instance()->mFileMonitor->addPath( path, regex );
-	WatchedTarget obj = WatchedTarget( wid , path, regex, callback );
-	auto it = instance()->mRegisteredCallbacks.insert( std::pair<uint64_t, WatchCallback>( wid, obj.mCallback ) );
+	return instance()->addFileWatchBatch( file, std::move( callback ), flags );
+}
+
+WatchedTarget FileWatcher::watchPathBatch( const fs::path &path,
+										   const std::string &regex,
+										   WatchBatchCallback callback,
+										   const std::vector<std::string> &excludes,
+										   uint32_t flags )
+{
+	return instance()->addPathWatchBatch( path, regex, std::move( callback ), excludes, flags );
+}
+
+WatchedTarget FileWatcher::addFileWatchBatch( const fs::path &file,
+											  WatchBatchCallback callback,
+											  uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( file, flags );
+	uint64_t wid = monitor().addFile( file, flags );
+	RegisteredCallback *registered = acquireCallback();
+	registered->batchCallback = std::move( callback );
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , file );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addPathWatchBatch( const fs::path &path,
+											  const std::string &regex,
+											  WatchBatchCallback callback,
+											  const std::vector<std::string> &excludes,
+											  uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( fs::path(), flags );
+	uint64_t wid = monitor().addPath( path, regex, excludes, flags );
+	RegisteredCallback *registered = acquireCallback();
+	registered->batchCallback = std::move( callback );
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , path, regex );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addFileStream( const fs::path &file, uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( file, flags );
+	uint64_t wid = monitor().addFile( file, flags );
+	RegisteredCallback *registered = acquireCallback();
+	registered->stream = std::make_shared<EventStream>();
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , file );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addPathStream( const fs::path &path,
+										  const std::string &regex,
+										  const std::vector<std::string> &excludes,
+										  uint32_t flags )
+{
+	std::shared_ptr<ContentHashes> hashes = contentBaseline( fs::path(), flags );
+	uint64_t wid = monitor().addPath( path, regex, excludes, flags );
+	RegisteredCallback *registered = acquireCallback();
+	registered->stream = std::make_shared<EventStream>();
+	registerWatch( wid, registered );
+	WatchedTarget obj = WatchedTarget( this, wid , path, regex );
+	if( hashes ) {
+		watchContent( wid, hashes );
+	}
+	return obj;
+}
+
+WatchedTarget FileWatcher::addFileChannel( const fs::path &file, size_t capacity, uint32_t flags )
+{
+	if( flags & WATCH_CONTENT_HASH ) {
+		// channel events never pass through the hashing strands
+		throw std::invalid_argument( "FileWatcher::addFileChannel: WATCH_CONTENT_HASH isn't supported on channels" );
+	}
+	
+	// attached in the same batch as the add, no event reaches the shared queue first
+	WatchBatch batch( this );
+	uint64_t wid = monitor().addFile( file, flags );
+	// an empty entry, removeWatch() expects every watch to own a slot
+	registerWatch( wid, acquireCallback() );
+	WatchedTarget obj = WatchedTarget( this, wid , file );
+	obj.mChannel = std::make_shared<filemonitor::EventChannel>( capacity );
+	monitor().attachChannel( wid, obj.mChannel );
+	return obj;
+}
+
+WatchedTarget FileWatcher::addPathChannel( const fs::path &path,
+										   const std::string &regex,
+										   size_t capacity,
+										   const std::vector<std::string> &excludes,
+										   uint32_t flags )
+{
+	if( flags & WATCH_CONTENT_HASH ) {
+		throw std::invalid_argument( "FileWatcher::addPathChannel: WATCH_CONTENT_HASH isn't supported on channels" );
+	}
 	
-	// double check item didn't exist, should be impossible
-	CI_ASSERT( it.second );
+	WatchBatch batch( this );
+	uint64_t wid = monitor().addPath( path, regex, excludes, flags );
+	registerWatch( wid, acquireCallback() );
+	WatchedTarget obj = WatchedTarget( this, wid , path, regex );
+	obj.mChannel = std::make_shared<filemonitor::EventChannel>( capacity );
+	monitor().attachChannel( wid, obj.mChannel );
 	return obj;
 }
 
+void FileWatcher::registerWatch( uint64_t wid, RegisteredCallback *callback )
+{
+	bool registered = registerCallback( wid, callback );
+	
+	if( registered && mBackend != this ) {
+		// the backend owns the monitor and receives the event, it hands it over to us
+		FileWatcher *watcher = this;
+		registered = mBackend->registerCallback( wid, [watcher, wid]( const ci::fs::path &path, EventType type ) {
+			watcher->forwardEvent( wid, path, type );
+		} );
+		if( ! registered ) {
+			CallbackSlot *slot = findSlot( wid );
+			replaceCallback( *slot, nullptr );
+			slot->wid.store( 0 );
+		}
+	}
+	
+	if( ! registered ) {
+		// the callback table is full, nothing could ever be delivered to the watch
+		monitor().remove( wid );
+		throw std::length_error( "filewatcher::FileWatcher: out of callback slots, at most " +
+								 std::to_string( sCallbackChunks * sCallbackChunkSize ) + " watches can be active" );
+	}
+}
+
+void FileWatcher::forwardEvent( uint64_t wid, const ci::fs::path &path, EventType type )
+{
+	// runs on the backend's dispatching thread, mReadyEvents belongs to our polling thread
+	filemonitor::FileMonitorEvent ev( path, type, wid );
+	mForwardedHandlers.fetch_add( 1, std::memory_order_relaxed );
+	mIoService.post( [this, ev]() {
+		mForwardedHandlers.fetch_sub( 1, std::memory_order_relaxed );
+		queueEvent( ev );
+		if( mImmediateDispatch ) {
+			dispatchReadyEvents();
+		}
+	} );
+	
+	std::lock_guard<std::mutex> lock( mWakeMutex );
+	if( mWake ) {
+		mWake();
+	}
+}
+
+size_t FileWatcher::pendingHandlers() const
+{
+	size_t pending = mForwardedHandlers.load( std::memory_order_relaxed )
+				   + mWaiterHandlers.load( std::memory_order_relaxed )
+				   + mContentHandlers.load( std::memory_order_relaxed );
+	if( mFileMonitor ) {
+		pending += mFileMonitor->postedHandlers();
+	}
+	return pending;
+}
+
+size_t FileWatcher::getWatchCount()
+{
+	return monitor().watchCount();
+}
+
+void FileWatcher::setWatchBudget( size_t maxRoots )
+{
+	monitor().setWatchBudget( maxRoots );
+}
+
+void FileWatcher::beginBatch()
+{
+	monitor().beginBatch();
+}
+
+void FileWatcher::commitBatch()
+{
+	monitor().commitBatch();
+}
+
+void FileWatcher::setCallbackThreads( size_t threads )
+{
+	stopExecutor();
+	if( threads == 0 ) {
+		return;
+	}
+	
+	mExecutorService.reset( new boost::asio::io_service( threads ) );
+	mExecutorWork.reset( new boost::asio::io_service::work( *mExecutorService ) );
+	
+	// more strands than threads so unrelated watches rarely end up sharing one
+	for( size_t i = 0; i < threads * 4; ++i ) {
+		mExecutorStrands.emplace_back( new boost::asio::io_service::strand( *mExecutorService ) );
+	}
+	for( size_t i = 0; i < threads; ++i ) {
+		boost::asio::io_service *service = mExecutorService.get();
+		mExecutorThreads.emplace_back( [service]() { service->run(); } );
+	}
+}
+
+void FileWatcher::setUpdateBudget( std::chrono::microseconds budget )
+{
+	mUpdateBudget = budget;
+}
+
+size_t FileWatcher::getDeferredCount() const
+{
+	// the dispatch thread owns the queue in immediate mode and never defers
+	if( mImmediateDispatch ) {
+		return 0;
+	}
+	return mReadyEvents.size();
+}
+
+void FileWatcher::setLatency( double seconds )
+{
+	// shared by every instance on the backend
+	monitor().setLatency( seconds );
+}
+
+void FileWatcher::setImmediateDispatch( bool immediate )
+{
+	if( immediate == mImmediateDispatch ) {
+		return;
+	}
+	
+	if( immediate ) {
+		// flush what is already queued in order before the dispatch thread takes over
+		mIoService.poll();
+		dispatchReadyEvents();
+		mImmediateDispatch = true;
+		mDispatchThread = std::thread( [this]() { mIoService.run(); } );
+	}
+	else {
+		// queued handlers survive stop(), the next poll() picks them up
+		mIoService.stop();
+		mDispatchThread.join();
+		mIoService.reset();
+		mImmediateDispatch = false;
+	}
+}
+
+void FileWatcher::setWakeCallback( const std::function<void ()> &wake )
+{
+	if( mFileMonitor ) {
+		mFileMonitor->setWakeHandler( wake );
+	}
+	std::lock_guard<std::mutex> lock( mWakeMutex );
+	mWake = wake;
+}
+
+void FileWatcher::stopExecutor()
+{
+	if( ! mExecutorService ) {
+		return;
+	}
+	
+	// callbacks already queued still run
+	mExecutorWork.reset();
+	for( auto &thread : mExecutorThreads ) {
+		thread.join();
+	}
+	mExecutorThreads.clear();
+	mExecutorStrands.clear();
+	mExecutorService.reset();
+	
+	// the executor's guards are gone, whatever they held back can go
+	mCallbackReclaimer.collect();
+}
+
+std::shared_ptr<FileWatcher::ContentHashes> FileWatcher::contentBaseline( const ci::fs::path &file, uint32_t flags )
+{
+	if( ! ( flags & WATCH_CONTENT_HASH ) ) {
+		return nullptr;
+	}
+	
+	std::shared_ptr<ContentHashes> hashes = std::make_shared<ContentHashes>();
+	// files under a path watch get theirs the first time they show up instead
+	if( ! file.empty() ) {
+		// keyed like the events, which always carry absolute paths
+		std::string key = fs::absolute( file ).string();
+		filemonitor::ContentDigest digest;
+		if( filemonitor::statContent( key, digest ) ) {
+			hashes->files[key] = digest;
+		}
+	}
+	return hashes;
+}
+
+void FileWatcher::watchContent( uint64_t wid, const std::shared_ptr<ContentHashes> &hashes )
+{
+	if( ! mHashService ) {
+		// hashing is mostly waiting on the disk, a couple of threads keep it flowing
+		static const size_t sHashThreads = 2;
+		mHashService.reset( new boost::asio::io_service( sHashThreads ) );
+		mHashWork.reset( new boost::asio::io_service::work( *mHashService ) );
+		for( size_t i = 0; i < sHashThreads * 4; ++i ) {
+			mHashStrands.emplace_back( new boost::asio::io_service::strand( *mHashService ) );
+		}
+		for( size_t i = 0; i < sHashThreads; ++i ) {
+			boost::asio::io_service *service = mHashService.get();
+			mHashThreads.emplace_back( [service]() { service->run(); } );
+		}
+	}
+	
+	// queued ahead of any event of the watch, those can't reach the strand before
+	// mContentWatches knows about it
+	for( const auto &baseline : hashes->files ) {
+		std::string key = baseline.first;
+		size_t strand = std::hash<uint64_t>()( wid ) % mHashStrands.size();
+		mHashStrands[strand]->post( [hashes, key]() {
+			auto known = hashes->files.find( key );
+			if( known == hashes->files.end() || known->second.hashed ) {
+				return;
+			}
+			// the bytes only stand for the baseline if nothing could have been
+			// written since it was taken, otherwise the first MODIFIED reads them
+			filemonitor::ContentDigest digest;
+			if( filemonitor::hashContent( key, digest ) && filemonitor::isSettled( known->second )
+				&& digest.size == known->second.size && digest.mtime == known->second.mtime ) {
+				known->second = digest;
+			}
+		} );
+	}
+	
+	std::lock_guard<std::mutex> lock( mContentMutex );
+	mContentWatches[wid] = hashes;
+	++mContentWatchCount;
+}
+
+void FileWatcher::queueEvent( const filemonitor::FileMonitorEvent &ev )
+{
+	std::shared_ptr<ContentHashes> hashes;
+	if( mContentWatchCount.load( std::memory_order_relaxed ) > 0 ) {
+		std::lock_guard<std::mutex> lock( mContentMutex );
+		auto found = mContentWatches.find( ev.id );
+		if( found != mContentWatches.end() ) {
+			hashes = found->second;
+		}
+	}
+	if( ! hashes ) {
+		mReadyEvents.push_back( ev );
+		return;
+	}
+	
+	//! every event of the watch takes the same strand, so they stay in order
+	size_t strand = std::hash<uint64_t>()( ev.id ) % mHashStrands.size();
+	mHashStrands[strand]->post( [this, hashes, ev]() {
+		if( ! checkContent( *hashes, ev ) ) {
+			return;
+		}
+		mContentHandlers.fetch_add( 1, std::memory_order_relaxed );
+		mIoService.post( [this, ev]() {
+			mContentHandlers.fetch_sub( 1, std::memory_order_relaxed );
+			mReadyEvents.push_back( ev );
+			if( mImmediateDispatch ) {
+				dispatchReadyEvents();
+			}
+		} );
+		
+		std::lock_guard<std::mutex> lock( mWakeMutex );
+		if( mWake ) {
+			mWake();
+		}
+	} );
+}
+
+bool FileWatcher::checkContent( ContentHashes &hashes, const filemonitor::FileMonitorEvent &ev )
+{
+	std::string key = ev.getPath().string();
+	
+	switch( ev.type ) {
+		case filemonitor::FileMonitorEvent::REMOVED:
+		case filemonitor::FileMonitorEvent::RENAMED_OLD:
+			hashes.files.erase( key );
+			return true;
+		
+		case filemonitor::FileMonitorEvent::MODIFIED:
+		case filemonitor::FileMonitorEvent::ADDED:
+		case filemonitor::FileMonitorEvent::RENAMED_NEW:
+			break;
+		
+		default:
+			return true;
+	}
+	
+	filemonitor::ContentDigest current;
+	auto known = hashes.files.find( key );
+	if( known == hashes.files.end() ) {
+		// nothing to compare against yet, report it and remember the contents
+		if( filemonitor::hashContent( key, current ) ) {
+			hashes.files[key] = current;
+		}
+		return true;
+	}
+	
+	// a save through a temporary file arrives as a new file, it is always read
+	if( ev.type == filemonitor::FileMonitorEvent::MODIFIED ) {
+		if( ! filemonitor::statContent( key, current ) ) {
+			hashes.files.erase( known );
+			return true;
+		}
+		if( current.size == known->second.size && current.mtime == known->second.mtime
+			&& filemonitor::isSettled( known->second ) ) {
+			// same size and time, and the time was old enough to have moved on a write
+			return false;
+		}
+	}
+	if( ! filemonitor::hashContent( key, current ) ) {
+		hashes.files.erase( known );
+		return true;
+	}
+	
+	// a baseline from stat alone has nothing to compare the bytes with
+	bool changed = ! known->second.hashed || current.size != known->second.size
+		|| current.hash != known->second.hash;
+	known->second = current;
+	return changed;
+}
+
+void FileWatcher::stopContentHashing()
+{
+	if( ! mHashService ) {
+		return;
+	}
+	
+	mHashWork.reset();
+	for( auto &thread : mHashThreads ) {
+		thread.join();
+	}
+	mHashThreads.clear();
+	mHashStrands.clear();
+	mHashService.reset();
+}
+
 void FileWatcher::removeWatch( uint64_t wid )
 {
+	CallbackSlot *slot = findSlot( wid );
+	
+	CI_ASSERT( slot && slot->wid.load() == wid );
+	if( slot && slot->wid.load() == wid ) {
+		closeStream( wid );
+		
+		if( mContentWatchCount.load( std::memory_order_relaxed ) > 0 ) {
+			std::lock_guard<std::mutex> lock( mContentMutex );
+			if( mContentWatches.erase( wid ) ) {
+				--mContentWatchCount;
+			}
+		}
+		
+		// unlink the callback before releasing the slot, a callback that is running right
+		// now keeps going and is freed once it returns.  Nothing here waits for it.
+		replaceCallback( *slot, nullptr );
+		slot->wid.store( 0 );
+	}
+	
+	if( mBackend != this ) {
+		// drops the forwarder and the watch itself
+		mBackend->removeWatch( wid );
+	} else {
+		mFileMonitor->remove( wid );
+	}
+}
+	
+void FileWatcher::updateCallback( uint64_t wid, WatchCallback callback )
+{
+	CallbackSlot *slot = findSlot( wid );
+	CI_ASSERT( slot && slot->wid.load() == wid );
+	if( slot && slot->wid.load() == wid ) {
+		RegisteredCallback *registered = acquireCallback();
+		registered->callback = std::move( callback );
+		replaceCallback( *slot, registered );
+	}
+}
+
+void FileWatcher::updateBatchCallback( uint64_t wid, WatchBatchCallback callback )
+{
+	CallbackSlot *slot = findSlot( wid );
+	CI_ASSERT( slot && slot->wid.load() == wid );
+	if( slot && slot->wid.load() == wid ) {
+		RegisteredCallback *registered = acquireCallback();
+		registered->batchCallback = std::move( callback );
+		replaceCallback( *slot, registered );
+	}
+}
+
+bool FileWatcher::registerCallback( uint64_t wid, WatchCallback callback )
+{
+	RegisteredCallback *registered = acquireCallback();
+	registered->callback = std::move( callback );
+	return registerCallback( wid, registered );
+}
 
-	int r = instance()->mRegisteredCallbacks.erase( wid );
+bool FileWatcher::registerCallback( uint64_t wid, RegisteredCallback *registered )
+{
+	uint32_t index = filemonitor::handleSlot( wid );
+	if( index / sCallbackChunkSize >= sCallbackChunks ) {
+		releaseCallback( registered );
+		return false;
+	}
 	
-	CI_ASSERT( r == 1 );
-	mFileMonitor->remove( wid );
+	std::atomic<CallbackChunk*> &chunk = mCallbackChunks[index / sCallbackChunkSize];
+	CallbackChunk *callbacks = chunk.load();
+	if( ! callbacks ) {
+		// chunks are only ever added, a racing registration may win
+		CallbackChunk *fresh = new CallbackChunk;
+		if( chunk.compare_exchange_strong( callbacks, fresh ) ) {
+			callbacks = fresh;
+		} else {
+			delete fresh;
+		}
+	}
+	
+	CallbackSlot &slot = callbacks->slots[index % sCallbackChunkSize];
+	uint64_t expected = 0;
+	if( ! slot.wid.compare_exchange_strong( expected, wid ) ) {
+		releaseCallback( registered );
+		return false;
+	}
+	replaceCallback( slot, registered );
+	return true;
 }
+
+FileWatcher::CallbackSlot *FileWatcher::findSlot( uint64_t wid ) const
+{
+	uint32_t index = filemonitor::handleSlot( wid );
+	if( index / sCallbackChunkSize >= sCallbackChunks ) {
+		return nullptr;
+	}
+	CallbackChunk *callbacks = mCallbackChunks[index / sCallbackChunkSize].load();
+	return callbacks ? &callbacks->slots[index % sCallbackChunkSize] : nullptr;
+}
+
+const FileWatcher::RegisteredCallback *FileWatcher::findCallback( uint64_t wid ) const
+{
+	CallbackSlot *slot = findSlot( wid );
+	if( ! slot || slot->wid.load() != wid ) {
+		return nullptr;
+	}
+	const RegisteredCallback *registered = slot->registered.load();
 	
-void FileWatcher::updateCallback( uint64_t wid, const WatchCallback &callback )
+	// the slot may have been released and handed to a new watch in between, the
+	// generation in wid tells them apart
+	if( slot->wid.load() != wid ) {
+		return nullptr;
+	}
+	return registered;
+}
+
+void FileWatcher::replaceCallback( CallbackSlot &slot, RegisteredCallback *registered )
 {
-	int r = instance()->mRegisteredCallbacks.erase( wid );
-	CI_ASSERT( r == 1 );
-	instance()->mRegisteredCallbacks.insert( std::pair<uint64_t, WatchCallback>( wid, callback ) );
+	RegisteredCallback *previous = slot.registered.exchange( registered );
+	if( previous ) {
+		mCallbackReclaimer.retire( [this, previous]() { releaseCallback( previous ); } );
+	}
+}
+
+FileWatcher::RegisteredCallback *FileWatcher::acquireCallback()
+{
+	std::lock_guard<std::mutex> lock( mFreeCallbacksMutex );
+	if( mFreeCallbacks.empty() ) {
+		return new RegisteredCallback;
+	}
+	RegisteredCallback *registered = mFreeCallbacks.back().release();
+	mFreeCallbacks.pop_back();
+	return registered;
+}
+
+void FileWatcher::releaseCallback( RegisteredCallback *registered )
+{
+	// captures are released now, not when the entry is reused
+	registered->callback = nullptr;
+	registered->batchCallback = nullptr;
+	registered->stream.reset();
+	
+	std::lock_guard<std::mutex> lock( mFreeCallbacksMutex );
+	mFreeCallbacks.emplace_back( registered );
 }
 	
 
 void FileWatcher::update()
 {
+	// runs every frame, idle frames don't touch the io_service
+	if( mImmediateDispatch || ( mReadyEvents.empty() && pendingHandlers() == 0 ) ) {
+		return;
+	}
+	++mServicePolls;
 	mIoService.poll();
+	dispatchReadyEvents();
 }
 
-void FileWatcher::fileEventHandler( const boost::system::error_code &ec,
-								    const filemonitor::FileMonitorEvent &ev )
+void FileWatcher::fileEventsHandler( const boost::system::error_code &ec,
+									 const std::vector<filemonitor::FileMonitorEvent> &events )
 {
-	// TODO do stuff
-	cout << "EC: " << ec << endl;
-	cout << "EV: " << ev << endl << endl;
-	
-	//! re-process if no error
-	if( ! ec && ev.type != filemonitor::FileMonitorEvent::NONE )
-	{
-		auto it = mRegisteredCallbacks.find( ev.id );
+	//! queue up if no error, callbacks run from dispatchReadyEvents()
+	if( ! ec ) {
+		FILEMONITOR_TRACE( filemonitor::TRACE_INFO, filemonitor::TRACE_EVENTS_RECEIVED, events.size(), 0 );
+		for( const auto &ev : events ) {
+			FILEMONITOR_TRACE( filemonitor::TRACE_DEBUG, filemonitor::TRACE_EVENT, ev.id, ev.type );
+			if( ev.type != filemonitor::FileMonitorEvent::NONE ) {
+				queueEvent( ev );
+			}
+		}
 		
-		//! it's possible that we can remove a watch before the callback triggered,
-		//! so don't treat this as an error.
-		if( it != mRegisteredCallbacks.end() ) {
-			it->second( ev.path, ev.type );
+		if( mImmediateDispatch ) {
+			// running on the dispatch thread, nothing waits for a frame
+			dispatchReadyEvents();
 		}
 	} else {
 		//! TODO some error handling
+		FILEMONITOR_TRACE( filemonitor::TRACE_ERROR, filemonitor::TRACE_MONITOR_ERROR, ec.value(), 0 );
 	}
 	
 	
 	//! add the next handler
-	mFileMonitor->asyncMonitor( std::bind( &FileWatcher::fileEventHandler, this, std::placeholders::_1, std::placeholders::_2 ) );
+	mFileMonitor->asyncMonitorEvents( std::bind( &FileWatcher::fileEventsHandler, this, std::placeholders::_1, std::placeholders::_2 ) );
+}
+
+void FileWatcher::dispatchReadyEvents()
+{
+	if( mUpdateBudget.count() == 0 || mImmediateDispatch ) {
+		while( ! mReadyEvents.empty() ) {
+			filemonitor::FileMonitorEvent ev = std::move( mReadyEvents.front() );
+			mReadyEvents.pop_front();
+			dispatchEvent( ev );
+		}
+	}
+	else {
+		// at least one event per call, otherwise a single slow callback would stall the queue
+		auto deadline = std::chrono::steady_clock::now() + mUpdateBudget;
+		do {
+			if( mReadyEvents.empty() ) {
+				break;
+			}
+			filemonitor::FileMonitorEvent ev = std::move( mReadyEvents.front() );
+			mReadyEvents.pop_front();
+			dispatchEvent( ev );
+		} while( std::chrono::steady_clock::now() < deadline );
+	}
+	flushBatches();
+	flushStreams();
+	
+	// callbacks replaced while this dispatch held its guards are reclaimed here
+	mCallbackReclaimer.collect();
+}
+
+void FileWatcher::dispatchEvent( const filemonitor::FileMonitorEvent &ev )
+{
+	bool batched;
+	{
+		filemonitor::EpochReclaimer::Guard guard( mCallbackReclaimer );
+		const RegisteredCallback *registered = findCallback( ev.id );
+		if( registered && registered->stream ) {
+			//! the consumer resumes on its own executor, the strands aren't involved
+			pushStreamEvent( registered->stream, ev.getPath(), ev.type );
+			return;
+		}
+		batched = registered && registered->batchCallback;
+	}
+	if( batched ) {
+		collectBatchEvent( ev.id, ev.getPath(), ev.type );
+		return;
+	}
+	
+	if( mExecutorService ) {
+		//! a watch always maps to the same strand, which keeps its events in order
+		uint64_t wid = ev.id;
+		ci::fs::path path = ev.getPath();
+		EventType type = ev.type;
+		size_t strand = std::hash<uint64_t>()( wid ) % mExecutorStrands.size();
+		mExecutorStrands[strand]->post( [this, wid, path, type]() {
+			dispatchCallback( wid, path, type );
+		} );
+	} else {
+		dispatchCallback( ev.id, ev.getPath(), ev.type );
+	}
+}
+	
+void FileWatcher::dispatchCallback( uint64_t wid, const ci::fs::path &path, EventType type )
+{
+	//! no lock is taken, the guard keeps the callback alive even if its watch is
+	//! removed from another thread, or from inside the callback itself
+	filemonitor::EpochReclaimer::Guard guard( mCallbackReclaimer );
+	const RegisteredCallback *registered = findCallback( wid );
+	
+	//! it's possible that we can remove a watch before the callback triggered,
+	//! so don't treat this as an error.  The generation check also rejects
+	//! events for a removed watch whose slot has been reused since.
+	if( registered && registered->callback ) {
+		registered->callback( path, type );
+	}
+}
+	
+void FileWatcher::collectBatchEvent( uint64_t wid, const ci::fs::path &path, EventType type )
+{
+	auto found = mPendingBatches.find( wid );
+	if( found == mPendingBatches.end() ) {
+		found = mPendingBatches.emplace( wid, PendingBatch() ).first;
+		mPendingBatchOrder.push_back( wid );
+	}
+	PendingBatch &batch = found->second;
+	
+	auto entry = batch.index.find( path.string() );
+	if( entry == batch.index.end() ) {
+		batch.index.emplace( path.string(), batch.events.size() );
+		batch.events.push_back( WatchEvent( path, type ) );
+		return;
+	}
+	
+	EventType &pending = batch.events[entry->second].second;
+	if( pending == filemonitor::FileMonitorEvent::ADDED && type == filemonitor::FileMonitorEvent::REMOVED ) {
+		//! never existed as far as the callback is concerned, leave a hole that's
+		//! squeezed out on flush so the other indices stay valid
+		pending = filemonitor::FileMonitorEvent::NONE;
+	} else if( pending == filemonitor::FileMonitorEvent::ADDED && type == filemonitor::FileMonitorEvent::MODIFIED ) {
+		//! still new to the callback
+	} else if( pending == filemonitor::FileMonitorEvent::NONE && type == filemonitor::FileMonitorEvent::MODIFIED ) {
+		//! modified after a dropped add/remove, it's there again
+		pending = filemonitor::FileMonitorEvent::ADDED;
+	} else {
+		pending = type;
+	}
+}
+
+void FileWatcher::flushBatches()
+{
+	if( mPendingBatchOrder.empty() ) {
+		return;
+	}
+	
+	//! swap out first, a callback may poll or dispatch again
+	std::unordered_map<uint64_t, PendingBatch> batches;
+	std::vector<uint64_t> order;
+	batches.swap( mPendingBatches );
+	order.swap( mPendingBatchOrder );
+	
+	for( uint64_t wid : order ) {
+		std::vector<WatchEvent> &events = batches[wid].events;
+		events.erase( std::remove_if( events.begin(), events.end(), []( const WatchEvent &event ) {
+			return event.second == filemonitor::FileMonitorEvent::NONE;
+		} ), events.end() );
+		if( events.empty() ) {
+			continue;
+		}
+		
+		if( mExecutorService ) {
+			size_t strand = std::hash<uint64_t>()( wid ) % mExecutorStrands.size();
+			auto shared = std::make_shared<std::vector<WatchEvent>>( std::move( events ) );
+			mExecutorStrands[strand]->post( [this, wid, shared]() {
+				dispatchBatch( wid, *shared );
+			} );
+		} else {
+			dispatchBatch( wid, events );
+		}
+	}
+}
+
+void FileWatcher::pushStreamEvent( const std::shared_ptr<EventStream> &stream, const ci::fs::path &path, EventType type )
+{
+	std::lock_guard<std::mutex> lock( stream->mutex );
+	stream->buffered.push_back( WatchEvent( path, type ) );
+	
+	//! the waiter is completed once per dispatch, with everything that arrived in it
+	if( stream->waiter && ! stream->scheduled ) {
+		stream->scheduled = true;
+		mReadyStreams.push_back( stream );
+	}
+}
+
+void FileWatcher::flushStreams()
+{
+	std::vector<std::shared_ptr<EventStream>> streams;
+	streams.swap( mReadyStreams );
+	
+	for( const auto &stream : streams ) {
+		std::unique_ptr<EventWaiter> waiter;
+		std::vector<WatchEvent> events;
+		{
+			std::lock_guard<std::mutex> lock( stream->mutex );
+			stream->scheduled = false;
+			if( ! stream->waiter || stream->buffered.empty() ) {
+				continue;
+			}
+			waiter = std::move( stream->waiter );
+			takeEvents( *stream, stream->maxEvents, events );
+		}
+		waiter->complete( boost::system::error_code(), std::move( events ), false );
+	}
+}
+
+void FileWatcher::takeEvents( EventStream &stream, size_t maxEvents, std::vector<WatchEvent> &events )
+{
+	size_t count = std::min( std::max<size_t>( maxEvents, 1 ), stream.buffered.size() );
+	events.assign( std::make_move_iterator( stream.buffered.begin() ),
+				   std::make_move_iterator( stream.buffered.begin() + count ) );
+	stream.buffered.erase( stream.buffered.begin(), stream.buffered.begin() + count );
+}
+
+void FileWatcher::waitEvents( uint64_t wid, size_t maxEvents, std::unique_ptr<EventWaiter> waiter )
+{
+	std::shared_ptr<EventStream> stream;
+	{
+		filemonitor::EpochReclaimer::Guard guard( mCallbackReclaimer );
+		const RegisteredCallback *registered = findCallback( wid );
+		if( registered ) {
+			stream = registered->stream;
+		}
+	}
+	if( ! stream ) {
+		waiter->complete( boost::asio::error::bad_descriptor, std::vector<WatchEvent>(), true );
+		return;
+	}
+	
+	std::vector<WatchEvent> events;
+	{
+		std::lock_guard<std::mutex> lock( stream->mutex );
+		if( stream->waiter ) {
+			// only one consumer per watch
+			waiter->complete( boost::asio::error::already_started, std::vector<WatchEvent>(), true );
+			return;
+		}
+		if( stream->buffered.empty() ) {
+			stream->waiter = std::move( waiter );
+			stream->maxEvents = maxEvents;
+			return;
+		}
+		
+		takeEvents( *stream, maxEvents, events );
+	}
+	waiter->complete( boost::system::error_code(), std::move( events ), true );
+}
+
+void FileWatcher::closeStream( uint64_t wid )
+{
+	std::unique_ptr<EventWaiter> waiter;
+	{
+		filemonitor::EpochReclaimer::Guard guard( mCallbackReclaimer );
+		const RegisteredCallback *registered = findCallback( wid );
+		if( ! registered || ! registered->stream ) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock( registered->stream->mutex );
+		waiter = std::move( registered->stream->waiter );
+	}
+	if( waiter ) {
+		waiter->complete( boost::asio::error::operation_aborted, std::vector<WatchEvent>(), true );
+	}
+}
+
+void FileWatcher::dispatchBatch( uint64_t wid, const std::vector<WatchEvent> &events )
+{
+	filemonitor::EpochReclaimer::Guard guard( mCallbackReclaimer );
+	const RegisteredCallback *registered = findCallback( wid );
+	
+	//! the watch may have been removed or switched back to single events since
+	if( registered && registered->batchCallback ) {
+		registered->batchCallback( events );
+	}
 }
 	
 // ----------------------------------------------------------------------------------------------------
@@ -141,40 +1074,54 @@ void FileWatcher::fileEventHandler( const boost::system::error_code &ec,
 // ----------------------------------------------------------------------------------------------------
 WatchedTarget::~WatchedTarget()
 {
-	cout << "Destructor called";
 	//! mWatchID of 0 means we're a dead object who transfered ownership
 	if( mWatchId > 0 ) {
-		FileWatcher::instance()->removeWatch( mWatchId );
-		cout <<", and removed a watch";
+		FILEMONITOR_TRACE( filemonitor::TRACE_DEBUG, filemonitor::TRACE_WATCH_REMOVED, mWatchId, 0 );
+		mWatcher->removeWatch( mWatchId );
 	}
-	cout << "." << endl;
 }
 
 WatchedTarget::WatchedTarget( WatchedTarget &&other )
 {
+	mWatcher = other.mWatcher;
 	mWatchId = other.mWatchId;
 	mPath = other.mPath;
-	mCallback = other.mCallback;
 	mRegexMatch = other.mRegexMatch;
+	mChannel = std::move( other.mChannel );
 	
 	//! Setting id to 0 tells us it's a dead object
+	other.mWatcher = nullptr;
 	other.mWatchId = 0;
 	other.mPath = "";
-	other.mCallback = nullptr;
 	other.mRegexMatch = "";
 }
 
+void WatchedTarget::updateCallback( WatchCallback callback )
+{
+	if( mWatchId > 0 ) {
+		mWatcher->updateCallback( mWatchId, std::move( callback ) );
+	}
+}
+
+void WatchedTarget::updateBatchCallback( WatchBatchCallback callback )
+{
+	if( mWatchId > 0 ) {
+		mWatcher->updateBatchCallback( mWatchId, std::move( callback ) );
+	}
+}
+
 WatchedTarget& WatchedTarget::operator=( WatchedTarget &&rhs )
 {
+	mWatcher = rhs.mWatcher;
 	mWatchId = rhs.mWatchId;
 	mPath = rhs.mPath;
-	mCallback = rhs.mCallback;
 	mRegexMatch = rhs.mRegexMatch;
+	mChannel = std::move( rhs.mChannel );
 	
 	//! Setting id to 0 tells us it's a dead object
+	rhs.mWatcher = nullptr;
 	rhs.mWatchId = 0;
 	rhs.mPath = "";
-	rhs.mCallback = nullptr;
 	rhs.mRegexMatch = "";
 	
 	return *this;
@@ -0,0 +1,104 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ContentDigest.h"
+#include "PathHash.h"
+
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace filemonitor {
+
+namespace {
+
+//! HFS+ keeps whole seconds, everything else we run on is finer
+const int64_t sTimeResolutionNs = 1000000000;
+
+void fromStat( const struct stat &info, ContentDigest &digest )
+{
+	digest.size = static_cast<uintmax_t>( info.st_size );
+#if defined( __APPLE__ )
+	digest.mtime = static_cast<int64_t>( info.st_mtimespec.tv_sec ) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	digest.mtime = static_cast<int64_t>( info.st_mtim.tv_sec ) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+	digest.checked = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch() ).count();
+	digest.hashed = false;
+}
+
+} // anonymous namespace
+
+bool isSettled( const ContentDigest &digest )
+{
+	return digest.checked - digest.mtime > sTimeResolutionNs;
+}
+
+bool statContent( const std::string &path, ContentDigest &digest )
+{
+	struct stat info;
+	if( ::stat( path.c_str(), &info ) != 0 || ! S_ISREG( info.st_mode ) ) {
+		return false;
+	}
+	fromStat( info, digest );
+	return true;
+}
+
+bool hashContent( const std::string &path, ContentDigest &digest )
+{
+	int fd = ::open( path.c_str(), O_RDONLY );
+	if( fd < 0 ) {
+		return false;
+	}
+	
+	struct stat info;
+	if( ::fstat( fd, &info ) != 0 || ! S_ISREG( info.st_mode ) ) {
+		::close( fd );
+		return false;
+	}
+	fromStat( info, digest );
+	
+	if( digest.size == 0 ) {
+		// nothing to map
+		digest.hash = hashBytes( nullptr, 0 );
+		digest.hashed = true;
+		::close( fd );
+		return true;
+	}
+	
+	// the mapping is read front to back once, let the kernel read ahead aggressively
+	void *data = ::mmap( nullptr, digest.size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+	if( data == MAP_FAILED ) {
+		return false;
+	}
+	::madvise( data, digest.size, MADV_SEQUENTIAL );
+	digest.hash = hashBytes( static_cast<const char*>( data ), digest.size );
+	digest.hashed = true;
+	::munmap( data, digest.size );
+	return true;
+}
+
+} // namespace filemonitor
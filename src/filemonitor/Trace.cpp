@@ -0,0 +1,204 @@
+/*
+ Copyright (c) 2016, Lucas Vickers - All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+ the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+ the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace filemonitor {
+
+namespace {
+
+//! Rings of the threads that traced and are still running
+struct TraceRegistry {
+	std::mutex										mutex;
+	std::vector<std::shared_ptr<SpscRing<TraceRecord>>>	rings;
+	//! records left behind by exited threads, kept until collected
+	std::vector<TraceRecord>						orphaned;
+	//! dropped by exited threads, or because too much was left behind
+	size_t											orphanedDropped = 0;
+	std::atomic<uint32_t>							nextThread{ 0 };
+	
+	std::mutex										drainMutex;
+	std::condition_variable							drainCond;
+	std::thread										drainThread;
+	std::FILE										*drainFile = nullptr;
+	bool											draining = false;
+};
+
+TraceRegistry &registry()
+{
+	// leaked on purpose, threads may still trace during static destruction
+	static TraceRegistry *sRegistry = new TraceRegistry;
+	return *sRegistry;
+}
+
+//! Owns the calling thread's ring, which is drained and unregistered when the thread exits
+struct ThreadRing {
+	~ThreadRing()
+	{
+		if( ! ring ) {
+			return;
+		}
+		
+		TraceRegistry &traces = registry();
+		std::lock_guard<std::mutex> lock( traces.mutex );
+		// bounded like a ring, threads that come and go can't grow it without limit
+		TraceRecord record;
+		while( ring->tryPop( record ) ) {
+			if( traces.orphaned.size() < Trace::sRingCapacity ) {
+				traces.orphaned.push_back( record );
+			} else {
+				++traces.orphanedDropped;
+			}
+		}
+		traces.orphanedDropped += ring->dropped();
+		traces.rings.erase( std::remove( traces.rings.begin(), traces.rings.end(), ring ), traces.rings.end() );
+	}
+	
+	std::shared_ptr<SpscRing<TraceRecord>>	ring;
+	uint32_t								thread = 0;
+};
+
+thread_local ThreadRing tRing;
+
+//! Writes buffered records to file, expects drainMutex
+void drainTo( std::FILE *file )
+{
+	std::vector<TraceRecord> records;
+	Trace::collect( records );
+	if( ! records.empty() ) {
+		std::fwrite( records.data(), sizeof( TraceRecord ), records.size(), file );
+		std::fflush( file );
+	}
+}
+
+} // anonymous namespace
+
+const size_t Trace::sRingCapacity;
+
+Trace::Ring &Trace::threadRing()
+{
+	if( ! tRing.ring ) {
+		TraceRegistry &traces = registry();
+		tRing.ring = std::make_shared<Ring>( sRingCapacity );
+		tRing.thread = traces.nextThread.fetch_add( 1, std::memory_order_relaxed );
+		
+		std::lock_guard<std::mutex> lock( traces.mutex );
+		traces.rings.push_back( tRing.ring );
+	}
+	return *tRing.ring;
+}
+
+void Trace::record( uint8_t level, uint16_t kind, uint64_t a, uint64_t b )
+{
+	Ring &ring = threadRing();
+	
+	TraceRecord record;
+	record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+	record.a = a;
+	record.b = b;
+	record.thread = tRing.thread;
+	record.kind = kind;
+	record.level = level;
+	record.reserved = 0;
+	ring.tryPush( std::move( record ) );
+}
+
+size_t Trace::collect( std::vector<TraceRecord> &records )
+{
+	TraceRegistry &traces = registry();
+	
+	// the lock makes every ring single consumer, producers never take it after registering
+	std::lock_guard<std::mutex> lock( traces.mutex );
+	size_t count = traces.orphaned.size();
+	records.insert( records.end(), traces.orphaned.begin(), traces.orphaned.end() );
+	traces.orphaned.clear();
+	
+	TraceRecord record;
+	for( const auto &ring : traces.rings ) {
+		while( ring->tryPop( record ) ) {
+			records.push_back( record );
+			++count;
+		}
+	}
+	return count;
+}
+
+size_t Trace::dropped()
+{
+	TraceRegistry &traces = registry();
+	std::lock_guard<std::mutex> lock( traces.mutex );
+	size_t dropped = traces.orphanedDropped;
+	for( const auto &ring : traces.rings ) {
+		dropped += ring->dropped();
+	}
+	return dropped;
+}
+
+bool Trace::startDrain( const std::string &path, std::chrono::milliseconds interval )
+{
+	stopDrain();
+	
+	TraceRegistry &traces = registry();
+	std::lock_guard<std::mutex> lock( traces.drainMutex );
+	traces.drainFile = std::fopen( path.c_str(), "ab" );
+	if( ! traces.drainFile ) {
+		return false;
+	}
+	traces.draining = true;
+	traces.drainThread = std::thread( [&traces, interval]() {
+		std::unique_lock<std::mutex> lock( traces.drainMutex );
+		while( traces.draining ) {
+			traces.drainCond.wait_for( lock, interval );
+			drainTo( traces.drainFile );
+		}
+	} );
+	return true;
+}
+
+void Trace::stopDrain()
+{
+	TraceRegistry &traces = registry();
+	{
+		std::lock_guard<std::mutex> lock( traces.drainMutex );
+		if( ! traces.draining ) {
+			return;
+		}
+		traces.draining = false;
+	}
+	traces.drainCond.notify_all();
+	traces.drainThread.join();
+	
+	std::lock_guard<std::mutex> lock( traces.drainMutex );
+	drainTo( traces.drainFile );
+	std::fclose( traces.drainFile );
+	traces.drainFile = nullptr;
+}
+
+} // namespace filemonitor
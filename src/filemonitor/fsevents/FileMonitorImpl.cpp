@@ -23,78 +23,317 @@
 #include <boost/asio/error.hpp>
 
 #include <CoreServices/CoreServices.h>
+#include <algorithm>
+#include <unordered_set>
+#include <unistd.h>
 
 namespace filemonitor {
 
+namespace {
+
+//! True if path equals root or lives somewhere below it
+bool isBelowPath( const std::string &path, const std::string &root )
+{
+	if( root == "/" ) {
+		return ! path.empty() && path[0] == '/';
+	}
+	return path.size() >= root.size()
+		&& path.compare( 0, root.size(), root ) == 0
+		&& ( path.size() == root.size() || path[root.size()] == '/' );
+}
+
+//! Deepest directory of dir that exists, dir itself if it does
+boost::filesystem::path nearestExisting( const boost::filesystem::path &dir )
+{
+	// a relative path would end at its first component instead of an existing directory
+	assert( dir.is_absolute() );
+	boost::system::error_code ec;
+	boost::filesystem::path existing = dir;
+	while( ! boost::filesystem::is_directory( existing, ec ) && existing.has_parent_path() ) {
+		existing = existing.parent_path();
+	}
+	return existing;
+}
+
+//! Canonical directories reachable from root through symlinks, each paired with the
+//! logical prefix it is reached from.  Every canonical tree is crawled once, links into
+//! a tree that was already crawled (cycles included) only add an alias.
+std::vector<std::pair<std::string, std::string>> resolveAliases( const boost::filesystem::path &root )
+{
+	std::vector<std::pair<std::string, std::string>> aliases;
+	
+	boost::system::error_code ec;
+	boost::filesystem::path canonical = boost::filesystem::canonical( root, ec );
+	if( ec ) {
+		return aliases;
+	}
+	aliases.emplace_back( canonical.string(), root.string() );
+	
+	std::unordered_set<std::string, PathHash> crawled;
+	for( size_t next = 0; next < aliases.size(); ++next ) {
+		// copies, aliases grows while crawling
+		const std::string canonicalRoot = aliases[next].first;
+		const std::string logicalRoot = aliases[next].second;
+		
+		bool visited = false;
+		for( const auto &dir : crawled ) {
+			if( isBelowPath( canonicalRoot, dir ) ) {
+				visited = true;
+				break;
+			}
+		}
+		if( visited ) {
+			continue;
+		}
+		crawled.insert( canonicalRoot );
+		
+		// the iterator doesn't descend into symlinks, they are queued as roots of their own
+		boost::filesystem::recursive_directory_iterator it( canonicalRoot, ec ), end;
+		while( ! ec && it != end ) {
+			const boost::filesystem::path &entry = it->path();
+			if( crawled.count( entry.string() ) ) {
+				// an ancestor link reached a tree that was crawled already
+				it.no_push();
+			}
+			else if( boost::filesystem::is_symlink( it->symlink_status() ) && boost::filesystem::is_directory( it->status() ) ) {
+				boost::system::error_code linkEc;
+				boost::filesystem::path target = boost::filesystem::canonical( entry, linkEc );
+				if( ! linkEc ) {
+					aliases.emplace_back( target.string(), logicalRoot + entry.string().substr( canonicalRoot.size() ) );
+				}
+			}
+			it.increment( ec );
+		}
+	}
+	
+	return aliases;
+}
+
+} // anonymous namespace
+
 FileMonitorImpl::~FileMonitorImpl()
 {
+	// The arming thread is stopped first, it may touch the stream
+	{
+		std::lock_guard<std::mutex> lock( mPathsMutex );
+		mArmRun = false;
+		mArmCond.notify_all();
+	}
+	mArmThread.join();
+	
 	// The work thread is stopped and joined.
 	stopWorkThread();
 	mWorkThread.join();
 	stopFsevents();
 }
 
-uint64_t FileMonitorImpl::addPath( const boost::filesystem::path &path, const std::string &regexMatch )
+uint64_t FileMonitorImpl::addPath( const boost::filesystem::path &path,
+								   const std::string &regexMatch,
+								   const std::vector<std::string> &excludes,
+								   uint32_t flags )
 {
 	std::lock_guard<std::mutex> lock( mPathsMutex );
 	
-	uint64_t id = mNextPathId;
-	mNextPathId += 2;
+	uint64_t id = insertPathEntry( path, regexMatch, excludes, flags );
 	
-	auto iter = mPaths.emplace( id, PathEntry( path, regexMatch, id ) );
-	assert( iter.second );
+	restartFsevents();
 	
-	incrementTarget( path );
+	return id;
+}
+
+uint64_t FileMonitorImpl::addPathAsync( const boost::filesystem::path &path,
+										const std::string &regexMatch,
+										const std::vector<std::string> &excludes,
+										uint32_t flags,
+										const ArmHandler &handler )
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
 	
-	stopFsevents();
-	startFsevents();
+	uint64_t id;
+	if( flags & WATCH_FOLLOW_SYMLINKS ) {
+		// resolving links crawls the tree, the arming thread does that before routing sees the entry
+		id = mPaths.insert( PathEntry( path, regexMatch, mPatternCache.acquire( regexMatch ), excludes ) );
+		mPaths.get( id )->sinceId = registrationId();
+		mUnresolvedIds.push_back( id );
+	} else {
+		// routing knows about the entry right away, only the stream rebuild is deferred
+		id = insertPathEntry( path, regexMatch, excludes, flags );
+		if( mBatchDepth == 0 ) {
+			publishRoutes();
+		}
+	}
+	
+	mArmQueue.push_back( std::make_pair( id, handler ) );
+	mArmCond.notify_all();
 	
 	return id;
 }
 
-uint64_t FileMonitorImpl::addFile( const boost::filesystem::path &file )
+uint64_t FileMonitorImpl::insertPathEntry( const boost::filesystem::path &path,
+										   const std::string &regexMatch,
+										   const std::vector<std::string> &excludes,
+										   uint32_t flags )
+{
+	PatternCache::PatternRef regex = mPatternCache.acquire( regexMatch );
+	uint64_t id = mPaths.insert( PathEntry( path, regexMatch, regex, excludes ) );
+	PathEntry *entry = mPaths.get( id );
+	entry->sinceId = registrationId();
+	
+	if( flags & WATCH_FOLLOW_SYMLINKS ) {
+		entry->aliases = resolveAliases( path );
+	}
+	attachPattern( id, *entry );
+	
+	if( ! entry->aliases.empty() ) {
+		// one target per canonical directory, watches linking to the same place share it
+		entry->anchor = entry->aliases.front().first;
+		for( const auto &alias : entry->aliases ) {
+			incrementTarget( alias.first );
+		}
+		return id;
+	}
+	
+	if( flags & WATCH_PENDING ) {
+		entry->anchor = nearestExisting( path );
+		if( entry->anchor != path ) {
+			mPendingIds.push_back( id );
+			++mPendingCount;
+		}
+	}
+	
+	incrementTarget( entry->anchor );
+	
+	return id;
+}
+
+uint64_t FileMonitorImpl::addFile( const boost::filesystem::path &file, uint32_t flags )
 {
 	std::lock_guard<std::mutex> lock( mPathsMutex );
 	
-	uint64_t id = mNextFileId;
-	mNextFileId += 2;
+	// fsevents reports canonical paths, a linked file is routed by its target
+	boost::filesystem::path resolved = file;
+	if( flags & WATCH_FOLLOW_SYMLINKS ) {
+		boost::system::error_code ec;
+		boost::filesystem::path canonical = boost::filesystem::canonical( file, ec );
+		if( ! ec ) {
+			resolved = canonical;
+		}
+	}
+	
+	uint64_t id = mFiles.insert( FileEntry( resolved ) );
+	FileEntry *entry = mFiles.get( id );
+	entry->sinceId = registrationId();
+	if( resolved != file ) {
+		entry->logicalDir = std::make_shared<const boost::filesystem::path>( file.parent_path() );
+		entry->logicalName = file.filename().string();
+	}
 	
-	auto iter = mFiles.emplace( id, FileEntry( file, id ) );
-	assert( iter.second );
-	// iter.first is the multimap iter. iter is filesystem::path, pointer to the FileEntry
-	mFilesMmap.insert( std::make_pair( file, &(iter.first->second) ) );
+	// file lookups go through the parent directory node, then the filename
+	auto dirIter = mWatchedDirs.find( resolved.parent_path().string() );
+	if( dirIter == mWatchedDirs.end() ) {
+		dirIter = mWatchedDirs.emplace( resolved.parent_path().string(), WatchedDir( resolved.parent_path() ) ).first;
+	}
+	dirIter->second.files.insert( std::make_pair( resolved.filename().string(), id ) );
+	mDirtyDirs.insert( dirIter->first );
 	
-	assert( mFilesMmap.size() == mFiles.size() );
+	// a missing directory is covered by its nearest existing ancestor, fsevents
+	// watches recursively so the file is still routed once it shows up
+	if( flags & WATCH_PENDING ) {
+		entry->anchor = nearestExisting( resolved.parent_path() );
+		if( entry->anchor != resolved.parent_path() ) {
+			mPendingIds.push_back( id );
+			++mPendingCount;
+		}
+	}
 	
 	// increment the file target (can be multiple watches on a directory)
-	// fsevents wants the path not the file, so pass the parent_path
-	incrementTarget( file.parent_path() );
+	// fsevents wants the path not the file, so pass the anchor directory
+	incrementTarget( entry->anchor );
 	
-	stopFsevents();
-	startFsevents();
+	restartFsevents();
 	
 	return id;
 }
 
+size_t FileMonitorImpl::watchCount()
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	return mFiles.size() + mPaths.size();
+}
+
 void FileMonitorImpl::remove( uint64_t id )
 {
 	std::lock_guard<std::mutex> lock( mPathsMutex );
 	
-	boost::filesystem::path path;
+	std::vector<boost::filesystem::path> targets;
 	
-	// remove from containers
-	if( id % 2 == 0 ) {
-		// even is file
-		path = removeEntry<decltype( mFiles ), decltype( mFilesMmap )>( id, mFiles, mFilesMmap );
-		decrementTarget( path.parent_path() );
+	// remove from containers, a stale handle's generation no longer matches its slot
+	if( handleKind( id ) == HANDLE_FILE ) {
+		const FileEntry *entry = mFiles.get( id );
+		if( ! entry ) {
+			return;
+		}
+		targets.push_back( entry->anchor );
+		removeFileEntry( id );
 	} else {
-		// odd is path
-		path = removeEntry<decltype( mPaths )>( id, mPaths );
-		decrementTarget( path );
+		PathEntry *entry = mPaths.get( id );
+		if( ! entry ) {
+			return;
+		}
+		auto unresolved = std::find( mUnresolvedIds.begin(), mUnresolvedIds.end(), id );
+		if( unresolved != mUnresolvedIds.end() ) {
+			// never routed nor streamed, only the pattern was taken
+			mUnresolvedIds.erase( unresolved );
+			mPatternCache.release( entry->pattern );
+			mPaths.erase( id );
+			return;
+		}
+		if( entry->aliases.empty() ) {
+			targets.push_back( entry->anchor );
+		}
+		for( const auto &alias : entry->aliases ) {
+			targets.push_back( alias.first );
+		}
+		detachPattern( id, *entry );
+		mPaths.erase( id );
+	}
+	for( const auto &target : targets ) {
+		decrementTarget( target );
 	}
 	
-	stopFsevents();
-	startFsevents();
+	auto pending = std::find( mPendingIds.begin(), mPendingIds.end(), id );
+	if( pending != mPendingIds.end() ) {
+		mPendingIds.erase( pending );
+		--mPendingCount;
+	}
+	if( mChannels.erase( id ) ) {
+		mChannelsDirty = true;
+	}
+	
+	restartFsevents();
+}
+
+void FileMonitorImpl::beginBatch()
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	++mBatchDepth;
+}
+
+void FileMonitorImpl::commitBatch()
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	assert( mBatchDepth > 0 );
+	
+	if( --mBatchDepth == 0 && mStreamDirty ) {
+		// everything staged during the batch is applied with a single stream rebuild
+		restartFsevents();
+	} else if( mBatchDepth == 0 && mRoutesDirty ) {
+		publishRoutes();
+	}
+	if( mBatchDepth == 0 && ! mArmQueue.empty() ) {
+		// asynchronous registrations were held back by the batch
+		mArmCond.notify_all();
+	}
 }
 
 void FileMonitorImpl::destroy()
@@ -121,7 +360,29 @@ FileMonitorEvent FileMonitorImpl::popFrontEvent( boost::system::error_code &ec )
 	return ev;
 }
 
-void FileMonitorImpl::verifyEvent( const boost::filesystem::path &path, FileMonitorEvent::EventType type )
+void FileMonitorImpl::popFrontEvents( std::vector<FileMonitorEvent> &events, boost::system::error_code &ec )
+{
+	std::unique_lock<std::mutex> lock( mEventsMutex );
+	while( mRun && mEvents.empty() ) {
+		mEventsCond.wait( lock );
+	}
+	if( ! mEvents.empty() ) {
+		ec = boost::system::error_code();
+		events.assign( mEvents.begin(), mEvents.end() );
+		mEvents.clear();
+	} else {
+		ec = boost::asio::error::operation_aborted;
+	}
+}
+
+void FileMonitorImpl::verifyEvent( const std::string &path, FileMonitorEvent::EventType type,
+								   FSEventStreamEventId eventId )
+{
+	routeEvent( path, type, eventId, mRouteScratch );
+}
+
+void FileMonitorImpl::routeEvent( const std::string &path, FileMonitorEvent::EventType type,
+								  FSEventStreamEventId eventId, RouteScratch &scratch )
 {
 	if( ! mRun ) {
 		return;
@@ -129,18 +390,216 @@ void FileMonitorImpl::verifyEvent( const boost::filesystem::path &path, FileMoni
 	
 	// TODO confirm this winds up in proper worker thread
 	
-	//! check for exact file matches, streamlined map search to keep complexity minimal
-	auto range = mFilesMmap.equal_range( path );
-	for( auto it = range.first; it != range.second; ++it ) {
-		pushBackEvent( FileMonitorEvent( path, type, it->second->entryID ) );
+	// a new directory may be on the way to a pending target, the arming thread moves
+	// the watch down.  Without the lock the wakeup can be missed, it also re-checks on a timer
+	if( ( type == FileMonitorEvent::ADDED || type == FileMonitorEvent::RENAMED_NEW )
+		&& mPendingCount.load( std::memory_order_relaxed ) > 0 ) {
+		mAdvanceRequested = true;
+		mArmCond.notify_all();
+	}
+	
+	// split into directory and name, the scratch buffers keep their capacity between events
+	size_t slash = path.rfind( '/' );
+	if( slash == std::string::npos ) {
+		// fsevents and the poller always report absolute paths
+		return;
+	}
+	scratch.dir.assign( path, 0, slash == 0 ? 1 : slash );
+	scratch.name.assign( path, slash + 1, std::string::npos );
+	
+	// holding the table keeps every route alive, registration can swap in a new one meanwhile
+	std::shared_ptr<const RoutingTable> routes = std::atomic_load( &mRoutes );
+	if( ! routes ) {
+		return;
+	}
+	
+	//! shared directory node handed to every event produced for this path
+	std::shared_ptr<const boost::filesystem::path> dir;
+	
+	//! check for exact file matches, (directory, name) lookups keep complexity minimal
+	const RoutingTable::DirRoute *dirRoute = routes->findDir( scratch.dir );
+	if( dirRoute ) {
+		dir = dirRoute->dir;
+		auto range = dirRoute->files.equal_range( scratch.name );
+		for( auto it = range.first; it != range.second; ++it ) {
+			const RoutingTable::FileRoute &route = it->second;
+			if( eventId < route.sinceId ) {
+				// replayed from before the watch existed
+				continue;
+			}
+			touch( *route.heat );
+			if( route.logicalDir ) {
+				// watched through a symlink, report the path the caller asked for
+				deliverEvent( routes, FileMonitorEvent( route.logicalDir, route.logicalName, type, route.id ) );
+			} else {
+				deliverEvent( routes, FileMonitorEvent( dir, scratch.name, type, route.id ) );
+			}
+		}
+	}
+	
+	//! check every distinct regex, which is computationally more expensive.
+	//! excluded subtrees and globs are rejected first so they never reach the regex,
+	//! and each shared pattern is evaluated at most once for all of its watches
+	for( const auto &group : routes->groups ) {
+		int matched = -1;
+		for( const auto &route : *group.second ) {
+			if( eventId < route.sinceId || route.excludes.excludes( path, route.root ) ) {
+				continue;
+			}
+			if( matched < 0 ) {
+				matched = std::regex_match( path, *group.first ) ? 1 : 0;
+			}
+			if( ! matched ) {
+				break;
+			}
+			touch( *route.heat );
+			if( ! dir ) {
+				dir = std::make_shared<const boost::filesystem::path>( scratch.dir );
+			}
+			deliverEvent( routes, FileMonitorEvent( dir, scratch.name, type, route.id ) );
+		}
+	}
+	
+	//! symlink following watches fan out to every logical path linking to the event
+	if( routes->aliased ) {
+		for( const auto &aliased : *routes->aliased ) {
+			routeAliased( routes, path, type, eventId, aliased.second, *aliased.first );
+		}
+	}
+}
+
+void FileMonitorImpl::routeAliased( const std::shared_ptr<const RoutingTable> &routes,
+									const std::string &path, FileMonitorEvent::EventType type, FSEventStreamEventId eventId,
+									const RoutingTable::PathRoute &route, const std::regex &regex )
+{
+	if( eventId < route.sinceId ) {
+		return;
+	}
+
+	for( const auto &alias : route.aliases ) {
+		if( ! isBelowPath( path, alias.first ) ) {
+			continue;
+		}
+		
+		std::string logical = alias.second + path.substr( alias.first.size() );
+		if( route.excludes.excludes( logical, route.root ) || ! std::regex_match( logical, regex ) ) {
+			continue;
+		}
+		
+		touch( *route.heat );
+		boost::filesystem::path logicalPath( logical );
+		deliverEvent( routes, FileMonitorEvent( std::make_shared<const boost::filesystem::path>( logicalPath.parent_path() ),
+												logicalPath.filename().string(), type, route.id ) );
+	}
+}
+
+void FileMonitorImpl::publishRoutes()
+{
+	std::shared_ptr<RoutingTable> routes = mRoutes ? std::make_shared<RoutingTable>( *mRoutes ) : std::make_shared<RoutingTable>();
+	
+	// shards are copied once no matter how many of their directories changed
+	std::shared_ptr<RoutingTable::DirShard> shards[RoutingTable::sDirShards];
+	for( const std::string &dirPath : mDirtyDirs ) {
+		size_t index = RoutingTable::dirShard( dirPath );
+		std::shared_ptr<RoutingTable::DirShard> &shard = shards[index];
+		if( ! shard ) {
+			shard = routes->dirs[index] ? std::make_shared<RoutingTable::DirShard>( *routes->dirs[index] )
+										: std::make_shared<RoutingTable::DirShard>();
+		}
+		
+		auto watchedDir = mWatchedDirs.find( dirPath );
+		if( watchedDir == mWatchedDirs.end() ) {
+			shard->erase( dirPath );
+			continue;
+		}
+		std::shared_ptr<RoutingTable::DirRoute> dirRoute = std::make_shared<RoutingTable::DirRoute>();
+		dirRoute->dir = watchedDir->second.dir;
+		for( const auto &file : watchedDir->second.files ) {
+			const FileEntry *entry = mFiles.get( file.second );
+			RoutingTable::FileRoute route = { file.second, entry->logicalDir, entry->logicalName, entry->sinceId, entry->heat };
+			dirRoute->files.insert( std::make_pair( file.first, route ) );
+		}
+		( *shard )[dirPath] = std::move( dirRoute );
+	}
+	for( size_t i = 0; i < RoutingTable::sDirShards; ++i ) {
+		if( shards[i] ) {
+			routes->dirs[i] = shards[i]->empty() ? nullptr : std::move( shards[i] );
+		}
+	}
+	mDirtyDirs.clear();
+	
+	if( ! mDirtyPatterns.empty() ) {
+		std::unordered_map<const std::regex*, std::shared_ptr<const std::vector<RoutingTable::PathRoute>>> previous;
+		for( auto &group : routes->groups ) {
+			previous[group.first.get()] = std::move( group.second );
+		}
+		routes->groups.clear();
+		routes->groups.reserve( mPatternGroups.size() );
+		for( const auto &group : mPatternGroups ) {
+			const PathEntry *first = mPaths.get( group.second.front() );
+			if( ! mDirtyPatterns.count( group.first ) ) {
+				routes->groups.push_back( std::make_pair( first->regexMatch, previous[group.first] ) );
+				continue;
+			}
+			auto groupRoutes = std::make_shared<std::vector<RoutingTable::PathRoute>>();
+			groupRoutes->reserve( group.second.size() );
+			for( uint64_t id : group.second ) {
+				const PathEntry *entry = mPaths.get( id );
+				RoutingTable::PathRoute route = { id, entry->path.string(), entry->excludes, entry->aliases, entry->sinceId, entry->heat };
+				groupRoutes->push_back( route );
+			}
+			routes->groups.push_back( std::make_pair( first->regexMatch, std::move( groupRoutes ) ) );
+		}
+		mDirtyPatterns.clear();
+	}
+	
+	if( mAliasedDirty ) {
+		// symlink following watches are few, their list is rebuilt whole
+		auto aliased = std::make_shared<RoutingTable::AliasedRoutes>();
+		for( uint64_t id : mAliasedPaths ) {
+			const PathEntry *entry = mPaths.get( id );
+			RoutingTable::PathRoute route = { id, entry->path.string(), entry->excludes, entry->aliases, entry->sinceId, entry->heat };
+			aliased->push_back( std::make_pair( entry->regexMatch, route ) );
+		}
+		routes->aliased = aliased->empty() ? nullptr : std::move( aliased );
+		mAliasedDirty = false;
+	}
+	
+	if( mChannelsDirty ) {
+		routes->channels = mChannels.empty() ? nullptr : std::make_shared<const RoutingTable::Channels>( mChannels );
+		mChannelsDirty = false;
 	}
+	mRoutesDirty = false;
 	
-	//! check every regex possibility, which is computationally more expensive
-	for( const auto &it : mPaths ) {
-		if( std::regex_match( path.string(), it.second.regexMatch ) ) {
-			pushBackEvent( FileMonitorEvent( path, type, it.second.entryID ) );
+	std::atomic_store( &mRoutes, std::shared_ptr<const RoutingTable>( std::move( routes ) ) );
+}
+
+void FileMonitorImpl::deliverEvent( const std::shared_ptr<const RoutingTable> &routes, FileMonitorEvent &&ev )
+{
+	if( routes->channels ) {
+		auto channel = routes->channels->find( ev.id );
+		if( channel != routes->channels->end() ) {
+			// a full channel drops the event and counts it, the consumer sees dropped()
+			std::lock_guard<std::mutex> lock( mChannelPushMutex );
+			channel->second->tryPush( std::move( ev ) );
+			return;
 		}
 	}
+	pushBackEvent( ev );
+}
+
+void FileMonitorImpl::attachChannel( uint64_t id, const std::shared_ptr<EventChannel> &channel )
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	mChannels[id] = channel;
+	mChannelsDirty = true;
+	
+	// an open batch publishes when it commits
+	if( mBatchDepth == 0 ) {
+		publishRoutes();
+	} else {
+		mRoutesDirty = true;
+	}
 }
 
 void FileMonitorImpl::pushBackEvent( const FileMonitorEvent &ev )
@@ -150,38 +609,80 @@ void FileMonitorImpl::pushBackEvent( const FileMonitorEvent &ev )
 	mEventsCond.notify_all();
 }
 
+FSEventStreamEventId FileMonitorImpl::registrationId()
+{
+	FSEventStreamEventId id = FSEventsGetCurrentEventId();
+	if( mUnstreamedSinceId == 0 || id < mUnstreamedSinceId ) {
+		mUnstreamedSinceId = id;
+	}
+	return id;
+}
+
 void FileMonitorImpl::startFsevents()
 {
-	if ( mPaths.size() == 0 && mFiles.size() == 0 ) {
+	if ( mStreamRoots.empty() ) {
+		// nothing to resume, a later stream must not replay the history in between
 		mFsevents = nullptr;
+		mResumeEventId = 0;
+		mUnstreamedSinceId = 0;
 		return;
 	}
 	
-	// Need to pass FSEvents an array of unique paths, both files and folders.
-	// We assume that there are no duplicates between pathsMmap and filesMmap
-	//  since one is only files and one only folders
+	// Need to pass FSEvents an array of unique paths.  The planned roots are the
+	// minimal covering set of all targets, nested targets ride on their ancestor.
 	
-	CFMutableArrayRef allPaths = CFArrayCreateMutable( kCFAllocatorDefault, mAllTargetsMap.size(), &kCFTypeArrayCallBacks );
+	CFMutableArrayRef allPaths = CFArrayCreateMutable( kCFAllocatorDefault, mStreamRoots.size(), &kCFTypeArrayCallBacks );
 	
-	for( const auto &path : mAllTargetsMap ) {
+	for( const auto &path : mStreamRoots ) {
 		
-		CFStringRef cfstr = CFStringCreateWithCString( kCFAllocatorDefault, path.first.string().c_str(), kCFStringEncodingUTF8 );
+		CFStringRef cfstr = CFStringCreateWithCString( kCFAllocatorDefault, path.c_str(), kCFStringEncodingUTF8 );
 		CFArrayAppendValue( allPaths, cfstr );
 		CFRelease(cfstr);
 	}
 	
+	// resume right after the last event the previous stream delivered, so changes made
+	// while the stream was being rebuilt are replayed instead of lost.  Watches added
+	// since then go back to their registration, which covers the arming window.  Routing
+	// drops anything older than the watch it matches, so each watch only sees the gap
+	// after its own registration filled in.
+	FSEventStreamEventId sinceWhen = mResumeEventId;
+	if( mUnstreamedSinceId != 0 && ( sinceWhen == 0 || mUnstreamedSinceId < sinceWhen ) ) {
+		sinceWhen = mUnstreamedSinceId;
+	}
+	if( sinceWhen == 0 ) {
+		sinceWhen = FSEventsGetCurrentEventId();
+	}
+	mUnstreamedSinceId = 0;
+	
+	// without NoDefer the first event after a quiet period also waits for the latency
+	FSEventStreamCreateFlags flags = kFSEventStreamCreateFlagFileEvents;
+	if( mLatency <= 0.0 ) {
+		flags |= kFSEventStreamCreateFlagNoDefer;
+	}
+	
 	FSEventStreamContext context = {0, this, NULL, NULL, NULL};
 	mFsevents = FSEventStreamCreate( kCFAllocatorDefault,
 									 &filemonitor::FileMonitorImpl::fseventsCallback,
 									 &context,
 									 allPaths,
-									 //todo determine when we need to support historical events (if ever, I hope never)
-									 kFSEventStreamEventIdSinceNow, 		// only new modifications
-									 (CFTimeInterval) 1.0, 					// 1 second latency interval
-									 kFSEventStreamCreateFlagFileEvents );
+									 sinceWhen, 							// only modifications after the last stream
+									 mLatency, 								// coalescing interval
+									 flags );
 	FSEventStreamRetain( mFsevents );
 	CFRelease( allPaths );
 	
+	// push excluded subtrees down so fseventsd never reports them
+	if( mFsevents && ! mStreamExclusions.empty() ) {
+		CFMutableArrayRef exclusionPaths = CFArrayCreateMutable( kCFAllocatorDefault, mStreamExclusions.size(), &kCFTypeArrayCallBacks );
+		for( const auto &path : mStreamExclusions ) {
+			CFStringRef cfstr = CFStringCreateWithCString( kCFAllocatorDefault, path.string().c_str(), kCFStringEncodingUTF8 );
+			CFArrayAppendValue( exclusionPaths, cfstr );
+			CFRelease( cfstr );
+		}
+		FSEventStreamSetExclusionPaths( mFsevents, exclusionPaths );
+		CFRelease( exclusionPaths );
+	}
+	
 	if( ! mFsevents )
 	{
 		// TODO move this out of boost namespace
@@ -200,10 +701,100 @@ void FileMonitorImpl::startFsevents()
 	FSEventStreamFlushAsync( mFsevents );
 }
 
+void FileMonitorImpl::restartFsevents()
+{
+	if( mBatchDepth > 0 ) {
+		mStreamDirty = true;
+		return;
+	}
+	
+	mStreamDirty = false;
+	
+	// routing sees the new watches before the stream does, replayed events find them
+	publishRoutes();
+	
+	std::vector<std::string> roots = planStreamRoots();
+	std::vector<std::string> polled = applyWatchBudget( roots );
+	std::vector<boost::filesystem::path> exclusions = kernelExclusions();
+	
+	// a root only leaves the stream once the arming thread has its baseline, so nothing
+	// changing between the rebuild and the first poll goes unnoticed
+	std::vector<std::string> demoting;
+	for( auto it = polled.begin(); it != polled.end(); ) {
+		if( std::binary_search( mPolledRoots.begin(), mPolledRoots.end(), *it ) || mBaselinedRoots.count( *it ) ) {
+			++it;
+		} else {
+			demoting.push_back( *it );
+			roots.push_back( *it );
+			it = polled.erase( it );
+		}
+	}
+	mBaselinedRoots.clear();
+	if( ! demoting.empty() ) {
+		std::sort( roots.begin(), roots.end() );
+	}
+	
+	if( polled != mPolledRoots || demoting != mDemotingRoots ) {
+		mPolledRoots.swap( polled );
+		mDemotingRoots.swap( demoting );
+		// wakes the arming thread, which also runs the poller
+		mArmCond.notify_all();
+	}
+	
+	if( mLatencyDirty ) {
+		mLatencyDirty = false;
+		stopFsevents();
+	}
+	
+	if( mFsevents && roots == mStreamRoots && exclusions == mStreamExclusions ) {
+		// the running stream already covers every target, new ones included
+		mUnstreamedSinceId = 0;
+		return;
+	}
+	
+	mStreamRoots.swap( roots );
+	mStreamExclusions.swap( exclusions );
+	
+	stopFsevents();
+	startFsevents();
+}
+
+std::vector<std::string> FileMonitorImpl::planStreamRoots() const
+{
+	// shortest first so an ancestor is always decided before its descendants
+	std::vector<const std::string*> targets;
+	targets.reserve( mAllTargetsMap.size() );
+	for( const auto &target : mAllTargetsMap ) {
+		targets.push_back( &target.first );
+	}
+	std::sort( targets.begin(), targets.end(), []( const std::string *a, const std::string *b ) {
+		return a->size() < b->size() || ( a->size() == b->size() && *a < *b );
+	} );
+	
+	std::unordered_set<std::string, PathHash> roots;
+	std::string ancestor;
+	for( const std::string *target : targets ) {
+		// fsevents watches are recursive, skip targets that already sit below a root
+		bool covered = roots.count( "/" ) > 0;
+		for( size_t slash = target->find( '/', 1 ); ! covered && slash != std::string::npos; slash = target->find( '/', slash + 1 ) ) {
+			ancestor.assign( *target, 0, slash );
+			covered = roots.count( ancestor ) > 0;
+		}
+		if( ! covered ) {
+			roots.insert( *target );
+		}
+	}
+	
+	std::vector<std::string> sorted( roots.begin(), roots.end() );
+	std::sort( sorted.begin(), sorted.end() );
+	return sorted;
+}
+
 void FileMonitorImpl::stopFsevents()
 {
 	if (mFsevents)
 	{
+		mResumeEventId = FSEventStreamGetLatestEventId( mFsevents );
 		FSEventStreamStop( mFsevents );
 		// TODO do we need to unschedule this?
 		// FSEventStreamUnscheduleFromRunLoop(mFsevents, mRunloop, kCFRunLoopDefaultMode);
@@ -213,6 +804,241 @@ void FileMonitorImpl::stopFsevents()
 	mFsevents = nullptr;
 }
 
+void FileMonitorImpl::setWatchBudget( size_t maxStreamRoots )
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	mWatchBudget = maxStreamRoots;
+	restartFsevents();
+}
+
+void FileMonitorImpl::setLatency( double seconds )
+{
+	std::lock_guard<std::mutex> lock( mPathsMutex );
+	if( seconds < 0.0 ) {
+		seconds = 0.0;
+	}
+	if( seconds == mLatency ) {
+		return;
+	}
+	mLatency = seconds;
+	
+	// the latency is fixed at creation, the running stream is rebuilt.  Inside a batch
+	// that waits for the commit, the old stream keeps delivering until then
+	mLatencyDirty = true;
+	restartFsevents();
+	mArmCond.notify_all();
+}
+
+std::chrono::milliseconds FileMonitorImpl::pollingDelay() const
+{
+	int64_t delay = static_cast<int64_t>( mLatency * 1000.0 );
+	return std::chrono::milliseconds( std::max<int64_t>( sMinPollingDelay, std::min<int64_t>( sPollingDelay, delay ) ) );
+}
+
+std::vector<std::string> FileMonitorImpl::applyWatchBudget( std::vector<std::string> &roots )
+{
+	std::vector<std::string> polled;
+	size_t budget = mWatchBudget;
+	if( budget == 0 || roots.size() <= budget ) {
+		return polled;
+	}
+	
+	// a target is as hot as the most recently active watch on it
+	std::unordered_map<std::string, int64_t, PathHash> targetHeat;
+	auto heatTarget = [&targetHeat]( const std::string &target, const Heat &heat ) {
+		int64_t &current = targetHeat[target];
+		current = std::max( current, heat->load( std::memory_order_relaxed ) );
+	};
+	for( const auto &entry : mFiles ) {
+		heatTarget( entry.anchor.string(), entry.heat );
+	}
+	for( const auto &entry : mPaths ) {
+		if( entry.aliases.empty() ) {
+			heatTarget( entry.anchor.string(), entry.heat );
+		}
+		for( const auto &alias : entry.aliases ) {
+			heatTarget( alias.first, entry.heat );
+		}
+	}
+	
+	// and a root as hot as the hottest target below it
+	std::unordered_map<std::string, int64_t, PathHash> rootHeat;
+	for( const auto &root : roots ) {
+		int64_t heat = 0;
+		for( const auto &target : targetHeat ) {
+			if( target.second > heat && isBelowPath( target.first, root ) ) {
+				heat = target.second;
+			}
+		}
+		rootHeat[root] = heat;
+	}
+	
+	// streamed roots get a head start, a polled root has to be clearly hotter to take their place
+	for( const auto &root : mStreamRoots ) {
+		auto it = rootHeat.find( root );
+		if( it != rootHeat.end() ) {
+			it->second += sBudgetHeatMargin;
+		}
+	}
+	
+	// hottest roots keep their place in the stream, the coldest are polled
+	std::stable_sort( roots.begin(), roots.end(), [&rootHeat]( const std::string &a, const std::string &b ) {
+		return rootHeat[a] > rootHeat[b];
+	} );
+	polled.assign( roots.begin() + budget, roots.end() );
+	roots.resize( budget );
+	
+	std::sort( roots.begin(), roots.end() );
+	std::sort( polled.begin(), polled.end() );
+	return polled;
+}
+
+void FileMonitorImpl::touch( std::atomic<int64_t> &heat )
+{
+	// heat is only needed to pick what to demote when over budget
+	if( mWatchBudget.load( std::memory_order_relaxed ) == 0 ) {
+		return;
+	}
+	
+	heat.store( std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count(), std::memory_order_relaxed );
+}
+
+bool FileMonitorImpl::pollRoots( const std::vector<std::string> &roots,
+								 const std::vector<boost::filesystem::path> &exclusions )
+{
+	bool changed = false;
+	
+	// baselines of roots that were demoted since, the others were promoted again meanwhile
+	for( auto &baseline : mPollBaselines ) {
+		if( std::find( roots.begin(), roots.end(), baseline.first ) != roots.end() ) {
+			mPollSnapshots[baseline.first].swap( baseline.second );
+		}
+	}
+	mPollBaselines.clear();
+	
+	// forget roots that were promoted back into the stream or removed
+	for( auto it = mPollSnapshots.begin(); it != mPollSnapshots.end(); ) {
+		if( std::find( roots.begin(), roots.end(), it->first ) == roots.end() ) {
+			it = mPollSnapshots.erase( it );
+		} else {
+			++it;
+		}
+	}
+	
+	for( const auto &root : roots ) {
+		PollSnapshot current;
+		scanRoot( root, exclusions, current );
+		
+		auto previous = mPollSnapshots.find( root );
+		if( previous == mPollSnapshots.end() ) {
+			// no baseline was taken at demotion, e.g. after a failed rebuild, the first scan becomes it
+			mPollSnapshots.emplace( root, std::move( current ) );
+			continue;
+		}
+		
+		for( const auto &entry : current ) {
+			auto old = previous->second.find( entry.first );
+			if( old == previous->second.end() ) {
+				routeEvent( entry.first, FileMonitorEvent::ADDED, sLiveEventId, mPollScratch );
+				changed = true;
+			} else if( old->second.mtime != entry.second.mtime || old->second.size != entry.second.size ) {
+				routeEvent( entry.first, FileMonitorEvent::MODIFIED, sLiveEventId, mPollScratch );
+				changed = true;
+			}
+		}
+		for( const auto &entry : previous->second ) {
+			if( current.find( entry.first ) == current.end() ) {
+				routeEvent( entry.first, FileMonitorEvent::REMOVED, sLiveEventId, mPollScratch );
+				changed = true;
+			}
+		}
+		
+		previous->second.swap( current );
+	}
+	
+	return changed;
+}
+
+void FileMonitorImpl::scanRoot( const std::string &root,
+								const std::vector<boost::filesystem::path> &exclusions,
+								PollSnapshot &snapshot )
+{
+	boost::system::error_code ec;
+	boost::filesystem::recursive_directory_iterator it( root, ec ), end;
+	while( ! ec && it != end ) {
+		const boost::filesystem::path &path = it->path();
+		
+		if( std::find( exclusions.begin(), exclusions.end(), path ) != exclusions.end() ) {
+			it.no_push();
+		} else {
+			PollStat stat;
+			boost::system::error_code statEc;
+			stat.mtime = boost::filesystem::last_write_time( path, statEc );
+			if( boost::filesystem::is_regular_file( it->status() ) ) {
+				stat.size = boost::filesystem::file_size( path, statEc );
+			}
+			snapshot.emplace( path.string(), stat );
+		}
+		
+		it.increment( ec );
+	}
+}
+
+std::vector<boost::filesystem::path> FileMonitorImpl::kernelExclusions() const
+{
+	// FSEventStreamSetExclusionPaths accepts at most this many paths
+	static const size_t sMaxExclusions = 8;
+	
+	std::vector<boost::filesystem::path> exclusions;
+	
+	for( const auto &entry : mPaths ) {
+		if( ! entry.aliases.empty() ) {
+			// the stream sees canonical paths, logical excludes don't map onto them
+			continue;
+		}
+		for( const auto &candidate : entry.excludes.subtreesBelow( entry.path ) ) {
+			if( exclusions.size() >= sMaxExclusions ) {
+				return exclusions;
+			}
+			
+			const std::string &candidateString = candidate.string();
+			bool safe = true;
+			
+			// a watched file or directory inside the subtree still needs its events
+			for( const auto &target : mAllTargetsMap ) {
+				if( isBelowPath( target.first, candidateString ) ) {
+					safe = false;
+					break;
+				}
+			}
+			
+			// every other path watch covering the subtree must exclude it as well
+			for( const auto &other : mPaths ) {
+				if( ! safe ) {
+					break;
+				}
+				for( const auto &alias : other.aliases ) {
+					if( isBelowPath( candidateString, alias.first ) ) {
+						safe = false;
+					}
+				}
+				const std::string &otherRoot = other.path.string();
+				if( isBelowPath( candidateString, otherRoot )
+					&& ! other.excludes.excludes( candidateString, otherRoot ) ) {
+					safe = false;
+				}
+			}
+			
+			if( safe && std::find( exclusions.begin(), exclusions.end(), candidate ) == exclusions.end() ) {
+				exclusions.push_back( candidate );
+			}
+		}
+	}
+	
+	return exclusions;
+}
+
 void FileMonitorImpl::fseventsCallback( ConstFSEventStreamRef streamRef,
 									    void *clientCallBackInfo,
 									    size_t numEvents,
@@ -230,7 +1056,9 @@ void FileMonitorImpl::fseventsCallback( ConstFSEventStreamRef streamRef,
 		// kFSEventStreamEventFlagItemIsDir
 		// kFSEventStreamEventFlagItemIsFile
 		
-		boost::filesystem::path path( paths[i] );
+		// reuse the scratch buffer, capacity is kept between events
+		std::string &path = impl->mScratchPath;
+		path.assign( paths[i] );
 		if( eventFlags[i] & kFSEventStreamEventFlagNone ) {
 			// TODO log this
 		}
@@ -239,23 +1067,23 @@ void FileMonitorImpl::fseventsCallback( ConstFSEventStreamRef streamRef,
 			// changed.  I should log errors and see if this ever actually happens.
 		}
 		if( eventFlags[i] & kFSEventStreamEventFlagItemCreated ) {
-			impl->verifyEvent( path, FileMonitorEvent::ADDED );
+			impl->verifyEvent( path, FileMonitorEvent::ADDED, eventIds[i] );
 		}
 		if( eventFlags[i] & kFSEventStreamEventFlagItemRemoved ) {
-			impl->verifyEvent( path, FileMonitorEvent::REMOVED );
+			impl->verifyEvent( path, FileMonitorEvent::REMOVED, eventIds[i] );
 		}
 		if( eventFlags[i] & kFSEventStreamEventFlagItemModified ) {
-			impl->verifyEvent( path, FileMonitorEvent::MODIFIED );
+			impl->verifyEvent( path, FileMonitorEvent::MODIFIED, eventIds[i] );
 		}
 		if( eventFlags[i] & kFSEventStreamEventFlagItemRenamed )
 		{
-			if( ! boost::filesystem::exists( path ) )
+			if( ::access( paths[i], F_OK ) != 0 )
 			{
-				impl->verifyEvent( path, FileMonitorEvent::RENAMED_OLD );
+				impl->verifyEvent( path, FileMonitorEvent::RENAMED_OLD, eventIds[i] );
 			}
 			else
 			{
-				impl->verifyEvent( path, FileMonitorEvent::RENAMED_NEW );
+				impl->verifyEvent( path, FileMonitorEvent::RENAMED_NEW, eventIds[i] );
 			}
 		}
 	}
@@ -287,20 +1115,260 @@ void FileMonitorImpl::stopWorkThread()
 	mRunloopCond.notify_all();
 }
 
+boost::filesystem::path FileMonitorImpl::removeFileEntry( uint64_t id )
+{
+	const FileEntry *entry = mFiles.get( id );
+	assert( entry );
+	
+	boost::filesystem::path path = entry->path;
+	
+	auto dirIter = mWatchedDirs.find( path.parent_path().string() );
+	assert( dirIter != mWatchedDirs.end() );
+	
+	auto &files = dirIter->second.files;
+	auto range = files.equal_range( path.filename().string() );
+	auto rangeIter = range.first;
+	while( rangeIter != range.second ) {
+		// check entries for match
+		if( rangeIter->second == id ) {
+			break;
+		}
+		++rangeIter;
+	}
+	assert( rangeIter != range.second );
+	
+	files.erase( rangeIter );
+	mDirtyDirs.insert( dirIter->first );
+	if( files.empty() ) {
+		mWatchedDirs.erase( dirIter );
+	}
+	mFiles.erase( id );
+	
+	return path;
+}
+
+void FileMonitorImpl::armThread()
+{
+	std::unique_lock<std::mutex> lock( mPathsMutex );
+	
+	while( mArmRun ) {
+		if( mBatchDepth == 0 && ( mAdvanceRequested.exchange( false ) || ! mPendingIds.empty() ) ) {
+			// pending watches are re-anchored on creations and on every wakeup
+			advancePending();
+		}
+		
+		if( mBatchDepth == 0 && ! mDemotingRoots.empty() ) {
+			takeBaselines( lock );
+			continue;
+		}
+		
+		if( mArmQueue.empty() || mBatchDepth > 0 ) {
+			if( mPolledRoots.empty() ) {
+				if( mPendingIds.empty() ) {
+					mArmCond.wait( lock );
+				} else {
+					mArmCond.wait_for( lock, pollingDelay() );
+				}
+				continue;
+			}
+			
+			// roots over the watch budget are polled instead of streamed
+			mArmCond.wait_for( lock, pollingDelay() );
+			if( ! mArmRun || ! mArmQueue.empty() || mAdvanceRequested ) {
+				continue;
+			}
+			
+			std::vector<std::string> roots = mPolledRoots;
+			std::vector<boost::filesystem::path> exclusions = mStreamExclusions;
+			lock.unlock();
+			bool changed = pollRoots( roots, exclusions );
+			lock.lock();
+			
+			// activity changes the heat ranking, rebalance so hot roots move into the stream
+			if( changed && mBatchDepth == 0 ) {
+				try {
+					restartFsevents();
+				}
+				catch( const boost::system::system_error & ) {
+					// the old stream is gone, the next restart rebuilds it from scratch
+				}
+			}
+			continue;
+		}
+		
+		if( ! mUnresolvedIds.empty() ) {
+			resolvePendingAliases( lock );
+		}
+		
+		// everything queued so far is armed with a single rebuild
+		std::vector<std::pair<uint64_t, ArmHandler>> armed;
+		armed.swap( mArmQueue );
+		
+		boost::system::error_code ec;
+		try {
+			restartFsevents();
+		}
+		catch( const boost::system::system_error &e ) {
+			ec = e.code();
+		}
+		
+		lock.unlock();
+		for( const auto &it : armed ) {
+			if( it.second ) {
+				it.second( it.first, ec );
+			}
+		}
+		lock.lock();
+	}
+	
+	// never armed, let the callers know
+	for( const auto &it : mArmQueue ) {
+		if( it.second ) {
+			it.second( it.first, boost::asio::error::operation_aborted );
+		}
+	}
+	mArmQueue.clear();
+}
+
+void FileMonitorImpl::resolvePendingAliases( std::unique_lock<std::mutex> &lock )
+{
+	std::vector<std::pair<uint64_t, boost::filesystem::path>> unresolved;
+	for( uint64_t id : mUnresolvedIds ) {
+		unresolved.emplace_back( id, mPaths.get( id )->path );
+	}
+	
+	// the crawl runs unlocked, watches removed meanwhile are skipped below
+	lock.unlock();
+	std::vector<std::vector<std::pair<std::string, std::string>>> resolved;
+	for( const auto &it : unresolved ) {
+		resolved.push_back( resolveAliases( it.second ) );
+	}
+	lock.lock();
+	
+	for( size_t i = 0; i < unresolved.size(); ++i ) {
+		uint64_t id = unresolved[i].first;
+		auto pending = std::find( mUnresolvedIds.begin(), mUnresolvedIds.end(), id );
+		if( pending == mUnresolvedIds.end() ) {
+			continue;
+		}
+		mUnresolvedIds.erase( pending );
+		
+		PathEntry *entry = mPaths.get( id );
+		entry->aliases = std::move( resolved[i] );
+		attachPattern( id, *entry );
+		if( entry->aliases.empty() ) {
+			// nothing to resolve, e.g. a pending target, it is anchored like any other path
+			entry->anchor = nearestExisting( entry->path );
+			if( entry->anchor != entry->path ) {
+				mPendingIds.push_back( id );
+				++mPendingCount;
+			}
+			incrementTarget( entry->anchor );
+		} else {
+			entry->anchor = entry->aliases.front().first;
+			for( const auto &alias : entry->aliases ) {
+				incrementTarget( alias.first );
+			}
+		}
+		
+		// the canonical roots replay from the registration, not from the resolution
+		if( mUnstreamedSinceId == 0 || entry->sinceId < mUnstreamedSinceId ) {
+			mUnstreamedSinceId = entry->sinceId;
+		}
+	}
+}
+
+void FileMonitorImpl::takeBaselines( std::unique_lock<std::mutex> &lock )
+{
+	std::vector<std::string> roots = mDemotingRoots;
+	std::vector<boost::filesystem::path> exclusions = mStreamExclusions;
+	
+	// the stream keeps covering the roots while they are walked
+	lock.unlock();
+	for( const auto &root : roots ) {
+		PollSnapshot &baseline = mPollBaselines[root];
+		baseline.clear();
+		scanRoot( root, exclusions, baseline );
+	}
+	lock.lock();
+	
+	for( const auto &root : roots ) {
+		if( std::find( mDemotingRoots.begin(), mDemotingRoots.end(), root ) != mDemotingRoots.end() ) {
+			mBaselinedRoots.insert( root );
+		}
+	}
+	
+	try {
+		restartFsevents();
+	}
+	catch( const boost::system::system_error & ) {
+		// the old stream is gone, the next restart rebuilds it from scratch
+	}
+	
+	// a batch opened during the walk defers the rebuild, its commit demotes the baselined roots
+	if( mDemotingRoots == roots ) {
+		mDemotingRoots.clear();
+	}
+}
+
+void FileMonitorImpl::advancePending()
+{
+	bool moved = false;
+	
+	for( auto it = mPendingIds.begin(); it != mPendingIds.end(); ) {
+		boost::filesystem::path *anchor;
+		boost::filesystem::path target;
+		if( handleKind( *it ) == HANDLE_FILE ) {
+			FileEntry *entry = mFiles.get( *it );
+			anchor = &entry->anchor;
+			target = entry->path.parent_path();
+		} else {
+			PathEntry *entry = mPaths.get( *it );
+			anchor = &entry->anchor;
+			target = entry->path;
+		}
+		
+		// walks down as directories appear, and back up if the anchor itself went away
+		boost::filesystem::path existing = nearestExisting( target );
+		if( existing != *anchor ) {
+			incrementTarget( existing );
+			decrementTarget( *anchor );
+			*anchor = existing;
+			moved = true;
+		}
+		
+		if( *anchor == target ) {
+			it = mPendingIds.erase( it );
+			--mPendingCount;
+		} else {
+			++it;
+		}
+	}
+	
+	if( moved ) {
+		try {
+			restartFsevents();
+		}
+		catch( const boost::system::system_error & ) {
+			// the old stream is gone, the next restart rebuilds it from scratch
+		}
+	}
+}
+
 void FileMonitorImpl::incrementTarget( const boost::filesystem::path &path )
 {
-	auto it = mAllTargetsMap.find( path );
+	auto it = mAllTargetsMap.find( path.string() );
 	if( it != mAllTargetsMap.end() ) {
 		it->second += 1;
 	} else {
-		auto it = mAllTargetsMap.insert( std::make_pair( path, 1 ) );
+		auto it = mAllTargetsMap.insert( std::make_pair( path.string(), 1 ) );
 		assert( it.second );
 	}
 }
 
 void FileMonitorImpl::decrementTarget( const boost::filesystem::path &path )
 {
-	auto it = mAllTargetsMap.find( path );
+	auto it = mAllTargetsMap.find( path.string() );
 	assert( it != mAllTargetsMap.end() );
 	
 	if( it->second == 1 ) {
@@ -310,4 +1378,37 @@ void FileMonitorImpl::decrementTarget( const boost::filesystem::path &path )
 	}
 }
 	
+void FileMonitorImpl::attachPattern( uint64_t id, const PathEntry &entry )
+{
+	if( ! entry.aliases.empty() ) {
+		mAliasedPaths.push_back( id );
+		mAliasedDirty = true;
+		return;
+	}
+	mPatternGroups[entry.regexMatch.get()].push_back( id );
+	mDirtyPatterns.insert( entry.regexMatch.get() );
+}
+
+void FileMonitorImpl::detachPattern( uint64_t id, const PathEntry &entry )
+{
+	if( ! entry.aliases.empty() ) {
+		mAliasedPaths.erase( std::remove( mAliasedPaths.begin(), mAliasedPaths.end(), id ), mAliasedPaths.end() );
+		mAliasedDirty = true;
+		mPatternCache.release( entry.pattern );
+		return;
+	}
+	
+	auto it = mPatternGroups.find( entry.regexMatch.get() );
+	assert( it != mPatternGroups.end() );
+	
+	auto &ids = it->second;
+	ids.erase( std::remove( ids.begin(), ids.end(), id ), ids.end() );
+	mDirtyPatterns.insert( it->first );
+	if( ids.empty() ) {
+		mPatternGroups.erase( it );
+	}
+	
+	mPatternCache.release( entry.pattern );
+}
+	
 } // filemonitor namespace
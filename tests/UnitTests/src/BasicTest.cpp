@@ -7,6 +7,7 @@
 
 #include "utils.h"
 #include "FileWatcher.h"
+#include "FileMonitorEvent.h"
 
 using namespace ci;
 using namespace std;
@@ -41,19 +42,511 @@ TEST_CASE( "BasicFileTest" )
 		writeToFile( dummy, "fake" );
 		writeToFile( dummy2, "fake" );
 		
-		// wait 2 seconds
-		std::chrono::time_point<std::chrono::system_clock> waitTime =
-			std::chrono::system_clock::now() + std::chrono::seconds( 2 );
-		
-		// poll the service to force a check before app updates
-		while( std::chrono::system_clock::now() < waitTime ) {
-			filewatcher::FileWatcher::instance()->poll();
-			ci::sleep( 1000 / 30 );
-		}
+		pollFor( std::chrono::seconds( 2 ) );
 
 		CI_ASSERT( actions[target].modified >= 1 );
 		CI_ASSERT( actions[dummy].modified == 0 );
 		CI_ASSERT( actions[dummy2].modified == 0 && actions[dummy2].added == 0 );
 
 	}
+	
+	SECTION( "File watched directly and through its parent's watch reports changes to both and nothing else." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		CI_ASSERT( createTestingDir( getTestingPath() / "nested" ) );
+		
+		fs::path target = getTestingPath() / "nested" / "nestedtest.txt";
+		fs::path unrelated = getTestingPath() / "nested" / "unrelated.txt";
+		writeToFile( target, "start" );
+		writeToFile( unrelated, "start" );
+		
+		ActionMap fileActions, pathActions;
+		filewatcher::WatchedTarget watchedPath = filewatcher::FileWatcher::watchPath( getTestingPath(), ".*nestedtest\\.txt",
+		  [ &pathActions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  pathActions[file].process( type );
+		  } );
+		filewatcher::WatchedTarget watchedFile = filewatcher::FileWatcher::watchFile( target,
+		  [ &fileActions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  fileActions[file].process( type );
+		  } );
+		
+		writeToFile( target, "finish" );
+		writeToFile( unrelated, "finish" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		// the nested target shares its parent's stream root, fsevents may still split a
+		// write into several notifications
+		CI_ASSERT( fileActions[target].modified >= 1 );
+		CI_ASSERT( pathActions[target].modified >= 1 );
+		CI_ASSERT( fileActions.size() == 1 && pathActions.size() == 1 );
+	}
+	
+	SECTION( "Pending file watch picks up a file created in directories that don't exist yet." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "later" / "nested" / "pending.txt";
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedFile = filewatcher::FileWatcher::watchFile( target,
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, filewatcher::WATCH_PENDING );
+		
+		fs::create_directories( target.parent_path() );
+		writeToFile( target, "appeared" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].added >= 1 || actions[target].modified >= 1 );
+	}
+	
+	SECTION( "Pending path watch arms once its directory is created and reports files added to it." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path dir = getTestingPath() / "later" / "nested";
+		fs::path target = dir / "pending.txt";
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedPath = filewatcher::FileWatcher::watchPath( dir, ".*\\.txt",
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, std::vector<std::string>(), filewatcher::WATCH_PENDING );
+		
+		fs::create_directories( dir );
+		// give the arming thread a chance to move the anchor down first
+		pollFor( std::chrono::seconds( 1 ) );
+		writeToFile( target, "appeared" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].added >= 1 );
+	}
+	
+	SECTION( "Pending watch anchors on the next existing ancestor when its anchor is deleted." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() / "first" ) );
+		
+		// anchored on first until second appears
+		fs::path target = getTestingPath() / "first" / "second" / "pending.txt";
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedFile = filewatcher::FileWatcher::watchFile( target,
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, filewatcher::WATCH_PENDING );
+		
+		fs::remove_all( getTestingPath() / "first" );
+		pollFor( std::chrono::seconds( 1 ) );
+		
+		fs::create_directories( target.parent_path() );
+		writeToFile( target, "appeared" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].added >= 1 || actions[target].modified >= 1 );
+	}
+	
+	SECTION( "Relative pending watch is resolved against the working directory." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path cwd = fs::current_path();
+		fs::current_path( getTestingPath() );
+		// the working directory as the system reports it, symlinks resolved
+		fs::path target = fs::current_path() / "relative" / "pending.txt";
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedFile = filewatcher::FileWatcher::watchFile( fs::path( "relative" ) / "pending.txt",
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, filewatcher::WATCH_PENDING );
+		fs::current_path( cwd );
+		
+		fs::create_directories( target.parent_path() );
+		writeToFile( target, "appeared" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].added >= 1 || actions[target].modified >= 1 );
+	}
+	
+	SECTION( "Symlinked file is followed and reported under the link path." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path store = getTestingPath() / "store";
+		CI_ASSERT( createTestingDir( store ) );
+		fs::path content = store / "content.txt";
+		fs::path link = getTestingPath() / "link.txt";
+		writeToFile( content, "start" );
+		fs::create_symlink( content, link );
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedLink = filewatcher::FileWatcher::watchFile( link,
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, filewatcher::WATCH_FOLLOW_SYMLINKS );
+		
+		writeToFile( content, "finish" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[link].modified >= 1 );
+		CI_ASSERT( actions[content].modified == 0 );
+	}
+	
+	SECTION( "Watch removed from inside its own callback stops dispatching without deadlocking." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "removaltest.txt";
+		fs::path other = getTestingPath() / "othertest.txt";
+		writeToFile( target, "start" );
+		writeToFile( other, "start" );
+		
+		// owned by the first callback, released when that callback is reclaimed, which
+		// retires another callback from inside the reclaimer
+		int otherCalls = 0;
+		std::shared_ptr<filewatcher::WatchedTarget> otherWatch = std::make_shared<filewatcher::WatchedTarget>(
+			filewatcher::FileWatcher::watchFile( other,
+			  [ &otherCalls ]( const ci::fs::path&, filewatcher::EventType ) {
+				  ++otherCalls;
+			  } ) );
+		
+		int calls = 0;
+		std::unique_ptr<filewatcher::WatchedTarget> watch;
+		watch.reset( new filewatcher::WatchedTarget( filewatcher::FileWatcher::watchFile( target,
+		  [ &calls, &watch, otherWatch ]( const ci::fs::path&, filewatcher::EventType ) {
+			  ++calls;
+			  // retires the callback that is running right now
+			  watch.reset();
+		  } ) ) );
+		otherWatch.reset();
+		
+		writeToFile( target, "middle" );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( calls == 1 );
+		CI_ASSERT( ! watch );
+		
+		writeToFile( target, "finish" );
+		writeToFile( other, "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( calls == 1 );
+		CI_ASSERT( otherCalls == 0 );
+	}
+	
+	SECTION( "Stream watch hands changes to a waiting asyncNextEvents() and aborts it on removal." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "streamtest.txt";
+		writeToFile( target, "start" );
+		
+		filewatcher::WatchedTarget stream = filewatcher::FileWatcher::instance()->addFileStream( target );
+		
+		// a reload loop, re-arms itself after every batch
+		ActionMap actions;
+		boost::system::error_code lastError;
+		std::function<void ( boost::system::error_code, std::vector<filewatcher::WatchEvent> )> next;
+		next = [ &actions, &lastError, &stream, &next ]( boost::system::error_code ec, std::vector<filewatcher::WatchEvent> events ) {
+			lastError = ec;
+			if( ec ) {
+				return;
+			}
+			for( const auto &event : events ) {
+				actions[event.first].process( event.second );
+			}
+			stream.asyncNextEvents( 8, next );
+		};
+		stream.asyncNextEvents( 8, next );
+		
+		writeToFile( target, "finish" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].modified >= 1 );
+		CI_ASSERT( ! lastError );
+		
+		// removing the watch completes the outstanding wait
+		{
+			filewatcher::WatchedTarget removed( std::move( stream ) );
+		}
+		filewatcher::FileWatcher::instance()->poll();
+		CI_ASSERT( lastError == boost::asio::error::operation_aborted );
+	}
+	
+	SECTION( "Content hashed file watch ignores rewrites with identical bytes." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "hashtest.txt";
+		writeToFile( target, "start" );
+		// old enough that an unchanged mtime proves the bytes weren't touched
+		ci::sleep( 1100 );
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedFile = filewatcher::FileWatcher::watchFile( target,
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, filewatcher::WATCH_CONTENT_HASH );
+		
+		// same bytes, newer modification time
+		ci::sleep( 100 );
+		writeToFile( target, "start" );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( actions[target].modified == 0 );
+		CI_ASSERT( actions[target].added == 0 );
+		
+		writeToFile( target, "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( actions[target].modified >= 1 );
+		
+		// same size within the same second, a one second mtime can't tell it apart
+		int modified = actions[target].modified;
+		writeToFile( target, "finest" );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( actions[target].modified > modified );
+		
+		// editors saving through a temporary file replace the target with the same bytes
+		modified = actions[target].modified;
+		fs::path temp = getTestingPath() / "hashtest.txt.tmp";
+		writeToFile( temp, "finest" );
+		fs::rename( temp, target );
+		pollFor( std::chrono::seconds( 2 ) );
+		CI_ASSERT( actions[target].modified == modified );
+		CI_ASSERT( actions[target].added == 0 );
+		CI_ASSERT( actions[target].renamedNew == 0 );
+	}
+	
+	SECTION( "Channel watches reject content hashing." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "hashtest.txt";
+		writeToFile( target, "start" );
+		
+		filewatcher::FileWatcher *watcher = filewatcher::FileWatcher::instance();
+		CHECK_THROWS_AS( watcher->addFileChannel( target, 16, filewatcher::WATCH_CONTENT_HASH ),
+						 std::invalid_argument );
+		CHECK_THROWS_AS( watcher->addPathChannel( getTestingPath(), ".*", 16,
+												  std::vector<std::string>(),
+												  filewatcher::WATCH_CONTENT_HASH ),
+						 std::invalid_argument );
+	}
+}
+
+TEST_CASE( "SymlinkPathTest" )
+{
+	SECTION( "Changes in a directory linked twice are reported under both links." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path shared = getTestingPath() / "shared";
+		fs::path project = getTestingPath() / "project";
+		CI_ASSERT( createTestingDir( shared ) );
+		CI_ASSERT( createTestingDir( project ) );
+		fs::path content = shared / "content.txt";
+		writeToFile( content, "start" );
+		fs::create_directory_symlink( shared, project / "first" );
+		fs::create_directory_symlink( shared, project / "second" );
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPath( project, ".*\\.txt",
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, std::vector<std::string>(), filewatcher::WATCH_FOLLOW_SYMLINKS );
+		
+		writeToFile( content, "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[project / "first" / "content.txt"].modified >= 1 );
+		CI_ASSERT( actions[project / "second" / "content.txt"].modified >= 1 );
+		CI_ASSERT( actions[content].modified == 0 );
+	}
+	
+	SECTION( "A link back to an ancestor is crawled once and reported one level deep." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path project = getTestingPath() / "project";
+		CI_ASSERT( createTestingDir( project / "nested" ) );
+		fs::path content = project / "nested" / "content.txt";
+		writeToFile( content, "start" );
+		fs::create_directory_symlink( project, project / "nested" / "loop" );
+		
+		// returning at all means resolving the links terminated
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPath( project, ".*\\.txt",
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  }, std::vector<std::string>(), filewatcher::WATCH_FOLLOW_SYMLINKS );
+		
+		writeToFile( content, "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		fs::path looped = project / "nested" / "loop" / "nested" / "content.txt";
+		CI_ASSERT( actions[content].modified >= 1 );
+		CI_ASSERT( actions[looped].modified >= 1 );
+		for( const auto &action : actions ) {
+			CI_ASSERT( action.first == content || action.first == looped );
+		}
+	}
+}
+
+TEST_CASE( "BasicPathAsyncTest" )
+{
+	SECTION( "Asynchronously added path watch reports being armed and then detects changes." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "asynctest.txt";
+		fs::path old = getTestingPath() / "asyncold.txt";
+		writeToFile( target, "start" );
+		// written before the watch exists, must not be reported
+		writeToFile( old, "start" );
+		
+		int armedCount = 0;
+		boost::system::error_code armedError;
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPathAsync( getTestingPath(), ".*async.*\\.txt",
+			[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				actions[file].process( type );
+			},
+			[ &armedCount, &armedError ]( const ci::fs::path&, const boost::system::error_code &ec ) {
+				++armedCount;
+				armedError = ec;
+			} );
+		
+		CI_ASSERT( watch.isPath() );
+		
+		pollUntil( [ &armedCount ]() { return armedCount > 0; }, std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( armedCount == 1 );
+		CI_ASSERT( ! armedError );
+		
+		writeToFile( target, "finish" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[target].modified >= 1 );
+		CI_ASSERT( actions[old].modified == 0 && actions[old].added == 0 );
+	}
+	
+	SECTION( "Asynchronous symlink path watch resolves its links while arming and reports under the link." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path real = getTestingPath() / "real";
+		fs::path link = getTestingPath() / "link";
+		CI_ASSERT( createTestingDir( real ) );
+		fs::create_directory_symlink( real, link );
+		writeToFile( real / "asynclinked.txt", "start" );
+		
+		int armedCount = 0;
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPathAsync( link, ".*asynclinked\\.txt",
+			[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				actions[file].process( type );
+			},
+			[ &armedCount ]( const ci::fs::path&, const boost::system::error_code & ) {
+				++armedCount;
+			}, std::vector<std::string>(), filewatcher::WATCH_FOLLOW_SYMLINKS );
+		
+		pollUntil( [ &armedCount ]() { return armedCount > 0; }, std::chrono::seconds( 2 ) );
+		CI_ASSERT( armedCount == 1 );
+		
+		writeToFile( real / "asynclinked.txt", "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[link / "asynclinked.txt"].modified >= 1 );
+		CI_ASSERT( actions[real / "asynclinked.txt"].modified == 0 );
+	}
+	
+	SECTION( "Asynchronous path watch rejects a directory that doesn't exist." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		bool threw = false;
+		try {
+			filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPathAsync( getTestingPath() / "missing", ".*",
+				[]( const ci::fs::path&, filewatcher::EventType ) { },
+				[]( const ci::fs::path&, const boost::system::error_code & ) { } );
+		} catch( const std::invalid_argument & ) {
+			threw = true;
+		}
+		CI_ASSERT( threw );
+	}
+}
+
+TEST_CASE( "EventPathTest" )
+{
+	SECTION( "Events keep a shared directory node and a name, getPath() joins them." )
+	{
+		fs::path file = fs::path( "/Users/someone/assets" ) / "texture.png";
+		
+		filemonitor::FileMonitorEvent split( file, filemonitor::FileMonitorEvent::MODIFIED, 2 );
+		CI_ASSERT( split.dir && *split.dir == file.parent_path() );
+		CI_ASSERT( split.name == "texture.png" );
+		CI_ASSERT( split.getPath() == file );
+		
+		// every event routed for one directory points at the same node
+		filemonitor::FileMonitorEvent first( split.dir, "a.png", filemonitor::FileMonitorEvent::ADDED, 2 );
+		filemonitor::FileMonitorEvent second( split.dir, "b.png", filemonitor::FileMonitorEvent::REMOVED, 4 );
+		CI_ASSERT( first.dir.get() == second.dir.get() );
+		CI_ASSERT( first.getPath() == file.parent_path() / "a.png" );
+		CI_ASSERT( second.getPath() == file.parent_path() / "b.png" );
+		
+		// copies share the node too, queueing an event doesn't copy its directory
+		filemonitor::FileMonitorEvent copy = first;
+		CI_ASSERT( copy.dir.get() == first.dir.get() && copy.getPath() == first.getPath() );
+		
+		filemonitor::FileMonitorEvent bare( std::shared_ptr<const fs::path>(), "loose.txt",
+											filemonitor::FileMonitorEvent::MODIFIED, 2 );
+		CI_ASSERT( bare.getPath() == fs::path( "loose.txt" ) );
+	}
+	
+	SECTION( "Path watches report the full path of changes at every depth." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path top = getTestingPath() / "top.txt";
+		fs::path middle = getTestingPath() / "one" / "middle.txt";
+		fs::path bottom = getTestingPath() / "one" / "two" / "bottom.txt";
+		CI_ASSERT( createTestingDir( bottom.parent_path() ) );
+		writeToFile( top, "start" );
+		writeToFile( middle, "start" );
+		writeToFile( bottom, "start" );
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPath( getTestingPath(), ".*\\.txt",
+		  [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+		  } );
+		
+		writeToFile( top, "finish" );
+		writeToFile( middle, "finish" );
+		writeToFile( bottom, "finish" );
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( allModified( actions, { top, middle, bottom } ) );
+		for( const auto &action : actions ) {
+			CI_ASSERT( action.first == top || action.first == middle || action.first == bottom );
+		}
+	}
 }
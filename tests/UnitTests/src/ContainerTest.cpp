@@ -4,9 +4,16 @@
 #include "catch.hpp"
 
 #include <chrono>
+#include <functional>
+#include <set>
+#include <sstream>
+#include <unordered_map>
 
 #include "utils.h"
 #include "FileWatcher.h"
+#include "InplaceFunction.h"
+#include "PathHash.h"
+#include "SlotMap.h"
 
 using namespace ci;
 using namespace std;
@@ -34,6 +41,251 @@ TEST_CASE( "BasicContainerTest" )
 		filewatcher::WatchedTargetMap<std::string> fileMap;
 		
 		// watch varied files and paths via container
+		fs::path file = root / "container.txt";
+		fs::path folder = root / "folder";
+		fs::path nested = folder / "nested.txt";
+		writeToFile( file, "start" );
+		prepPath( folder );
+		writeToFile( nested, "start" );
 		
+		fileMap.addWatch( "file", filewatcher::FileWatcher::watchFile( file, func ) );
+		fileMap.addWatch( "folder", filewatcher::FileWatcher::watchPath( folder, ".*\\.txt", func ) );
+		CI_ASSERT( fileMap.size() == 2 );
+		
+		writeToFile( file, "finish" );
+		writeToFile( nested, "finish" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( allModified( actions, { file, nested } ) );
+	}
+	
+	SECTION( "Handles of removed watches are rejected once their slot is reused" )
+	{
+		filemonitor::SlotMap<std::string, filemonitor::HANDLE_FILE> watches;
+		
+		uint64_t stale = watches.insert( "first" );
+		CI_ASSERT( watches.erase( stale ) );
+		uint64_t fresh = watches.insert( "second" );
+		
+		// same slot, newer generation
+		CI_ASSERT( filemonitor::handleSlot( stale ) == filemonitor::handleSlot( fresh ) );
+		CI_ASSERT( stale != fresh );
+		CI_ASSERT( watches.get( stale ) == nullptr );
+		CI_ASSERT( ! watches.erase( stale ) );
+		CI_ASSERT( watches.get( fresh ) != nullptr && *watches.get( fresh ) == "second" );
+	}
+	
+	SECTION( "Clearing a container removes all of its watches at once" )
+	{
+		std::vector<fs::path> files = createTestingFiles( "clear", 500 );
+		
+		ActionMap actions;
+		auto func = [ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			actions[file].process( type );
+		};
+		
+		size_t watchCount = filewatcher::FileWatcher::instance()->getWatchCount();
+		filewatcher::WatchedTargetMap<int> fileMap;
+		{
+			filewatcher::WatchBatch batch;
+			for( size_t i=0; i<files.size(); ++i ) {
+				fileMap.addWatch( i, filewatcher::FileWatcher::watchFile( files[i], func ) );
+			}
+		}
+		CI_ASSERT( filewatcher::FileWatcher::instance()->getWatchCount() == watchCount + files.size() );
+		
+		fileMap.clear();
+		
+		CI_ASSERT( fileMap.empty() );
+		CI_ASSERT( filewatcher::FileWatcher::instance()->getWatchCount() == watchCount );
+		
+		for( const auto &file : files ) {
+			writeToFile( file, "finish" );
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		for( const auto &file : files ) {
+			CI_ASSERT( actions[file].modified == 0 );
+		}
+	}
+}
+
+TEST_CASE( "WatcherInstanceTest" )
+{
+	SECTION( "Independent and shared-backend watchers only see their own watches" )
+	{
+		fs::path root = getTestingPath();
+		fs::remove_all( root );
+		CI_ASSERT( createTestingDir( root ) );
+		
+		fs::path hotFile = root / "hot.txt";
+		fs::path bulkFile = root / "bulk.txt";
+		fs::path sharedFile = root / "shared.txt";
+		writeToFile( hotFile, "start" );
+		writeToFile( bulkFile, "start" );
+		writeToFile( sharedFile, "start" );
+		
+		filewatcher::FileWatcher hot;
+		filewatcher::FileWatcher bulk;
+		filewatcher::FileWatcher shared( &bulk );
+		
+		ActionMap hotActions, bulkActions, sharedActions;
+		filewatcher::WatchedTarget hotWatch = hot.addFileWatch( hotFile,
+			[ &hotActions ]( const ci::fs::path& file, filewatcher::EventType type ) { hotActions[file].process( type ); } );
+		filewatcher::WatchedTarget bulkWatch = bulk.addFileWatch( bulkFile,
+			[ &bulkActions ]( const ci::fs::path& file, filewatcher::EventType type ) { bulkActions[file].process( type ); } );
+		filewatcher::WatchedTarget sharedWatch = shared.addFileWatch( sharedFile,
+			[ &sharedActions ]( const ci::fs::path& file, filewatcher::EventType type ) { sharedActions[file].process( type ); } );
+		
+		CI_ASSERT( sharedWatch.getWatcher() == &shared );
+		
+		writeToFile( hotFile, "finish" );
+		writeToFile( bulkFile, "finish" );
+		writeToFile( sharedFile, "finish" );
+		
+		// the shared watcher receives its events through the backend's poll
+		pollFor( std::chrono::seconds( 2 ), { &hot, &bulk, &shared } );
+		
+		CI_ASSERT( hotActions[hotFile].modified >= 1 );
+		CI_ASSERT( bulkActions[bulkFile].modified >= 1 );
+		CI_ASSERT( sharedActions[sharedFile].modified >= 1 );
+		CI_ASSERT( hotActions.size() == 1 && bulkActions.size() == 1 && sharedActions.size() == 1 );
+	}
+}
+
+TEST_CASE( "PathHashTest" )
+{
+	SECTION( "Paths are found by a PathHash keyed map, near misses are not" )
+	{
+		std::unordered_map<std::string, int, filemonitor::PathHash> dirs;
+		std::vector<std::string> paths;
+		for( int i=0; i<1000; ++i ) {
+			std::stringstream ss;
+			ss << "/Users/someone/Projects/assets/level" << i / 10 << "/textures" << i;
+			paths.push_back( ss.str() );
+			dirs[paths.back()] = i;
+		}
+		
+		for( size_t i=0; i<paths.size(); ++i ) {
+			auto it = dirs.find( paths[i] );
+			CI_ASSERT( it != dirs.end() && it->second == static_cast<int>( i ) );
+			
+			// a differing last byte, a missing one and an extra one all miss
+			std::string changed = paths[i];
+			changed.back() = 'x';
+			CI_ASSERT( dirs.find( changed ) == dirs.end() );
+			CI_ASSERT( dirs.find( paths[i].substr( 0, paths[i].size() - 1 ) + "/" ) == dirs.end() );
+			CI_ASSERT( dirs.find( paths[i] + "/" ) == dirs.end() );
+		}
+	}
+	
+	SECTION( "Hashes depend on every byte and on the length, not on where the bytes live" )
+	{
+		// long enough to go through the four lane loop, the 8 byte lane and the tail
+		std::string path = "/Volumes/Data/Projects/filewatcher/tests/UnitTests/src/fixtures/deeply/nested/file.txt";
+		
+		std::set<uint64_t> prefixes;
+		for( size_t len=0; len<=path.size(); ++len ) {
+			prefixes.insert( filemonitor::hashBytes( path.data(), len ) );
+		}
+		CI_ASSERT( prefixes.size() == path.size() + 1 );
+		
+		std::set<uint64_t> flipped;
+		for( size_t i=0; i<path.size(); ++i ) {
+			std::string changed = path;
+			changed[i] ^= 1;
+			flipped.insert( filemonitor::hashBytes( changed.data(), changed.size() ) );
+		}
+		CI_ASSERT( flipped.size() == path.size() );
+		CI_ASSERT( ! flipped.count( filemonitor::hashBytes( path.data(), path.size() ) ) );
+		
+		// unaligned copies hash the same as the original
+		std::vector<char> buffer( path.size() + 8 );
+		for( size_t offset=1; offset<8; ++offset ) {
+			std::copy( path.begin(), path.end(), buffer.begin() + offset );
+			CI_ASSERT( filemonitor::hashBytes( buffer.data() + offset, path.size() ) ==
+					   filemonitor::PathHash()( path ) );
+		}
+	}
+}
+
+namespace {
+
+//! Counts live copies, and reports where it is stored when called
+struct InplaceProbe {
+	explicit InplaceProbe( int *alive ) : alive( alive ) { ++*alive; }
+	InplaceProbe( InplaceProbe &&other ) : alive( other.alive ) { ++*alive; }
+	~InplaceProbe() { --*alive; }
+	
+	const void *operator()() const { return this; }
+	
+	int	*alive;
+};
+
+} // anonymous namespace
+
+TEST_CASE( "InplaceFunctionTest" )
+{
+	SECTION( "Targets are stored inside the function object and called with their captures" )
+	{
+		int alive = 0;
+		filemonitor::InplaceFunction<const void *()> where = InplaceProbe( &alive );
+		CI_ASSERT( alive == 1 );
+		
+		const char *begin = reinterpret_cast<const char*>( &where );
+		const char *stored = static_cast<const char*>( where() );
+		CI_ASSERT( stored >= begin && stored < begin + sizeof( where ) );
+		
+		int base = 40;
+		filemonitor::InplaceFunction<int ( int )> add = [base]( int value ) { return base + value; };
+		CI_ASSERT( add( 2 ) == 42 );
+	}
+	
+	SECTION( "Moving hands the target over and leaves the source empty" )
+	{
+		int alive = 0;
+		{
+			filemonitor::InplaceFunction<const void *()> first = InplaceProbe( &alive );
+			filemonitor::InplaceFunction<const void *()> second( std::move( first ) );
+			CI_ASSERT( ! first && second );
+			CI_ASSERT( alive == 1 );
+			
+			// the target moved into the new object's buffer
+			const char *begin = reinterpret_cast<const char*>( &second );
+			const char *stored = static_cast<const char*>( second() );
+			CI_ASSERT( stored >= begin && stored < begin + sizeof( second ) );
+			
+			// assigning over a target destroys it
+			filemonitor::InplaceFunction<const void *()> third = InplaceProbe( &alive );
+			CI_ASSERT( alive == 2 );
+			third = std::move( second );
+			CI_ASSERT( ! second && third );
+			CI_ASSERT( alive == 1 );
+			
+			third = nullptr;
+			CI_ASSERT( ! third );
+			CI_ASSERT( alive == 0 );
+			
+			third = InplaceProbe( &alive );
+		}
+		CI_ASSERT( alive == 0 );
+	}
+	
+	SECTION( "Empty callables make empty functions" )
+	{
+		filemonitor::InplaceFunction<void ()> none;
+		CI_ASSERT( ! none );
+		
+		filemonitor::InplaceFunction<void ()> fromNull = std::function<void ()>();
+		CI_ASSERT( ! fromNull );
+		
+		void (*pointer)() = nullptr;
+		filemonitor::InplaceFunction<void ()> fromPointer = pointer;
+		CI_ASSERT( ! fromPointer );
+		
+		filemonitor::InplaceFunction<void ()> fromLambda = []() { };
+		CI_ASSERT( fromLambda );
 	}
 }
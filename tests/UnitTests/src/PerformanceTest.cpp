@@ -0,0 +1,486 @@
+#include "cinder/app/Platform.h"
+#include "cinder/app/App.h"
+#include "cinder/Utilities.h"
+#include "catch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "utils.h"
+#include "FileWatcher.h"
+#include "Trace.h"
+
+using namespace ci;
+using namespace std;
+using namespace ci::app;
+
+
+TEST_CASE( "BatchRegistrationTest" )
+{
+	SECTION( "Many files are registered in a single batch and changes are detected within 2 seconds." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		int testSize = 1000;
+		
+		std::vector<fs::path> files;
+		for( int i=0; i<testSize; ++i ) {
+			std::stringstream ss;
+			ss << getTestingPath().string() << "/batch" << i << ".txt";
+			files.push_back( ss.str() );
+			
+			writeToFile( files.back(), "start" );
+		}
+		
+		ActionMap actions;
+		std::vector<filewatcher::WatchedTarget> watches;
+		
+		{
+			// everything registered in this scope is applied with one backend update
+			filewatcher::WatchBatch batch;
+			for( auto file : files ) {
+				watches.push_back( filewatcher::FileWatcher::watchFile( file,
+					[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+						actions[file].process( type );
+					} ) );
+			}
+		}
+		
+		// modify every 10th file
+		for( int i=0; i<testSize; i+=10 ) {
+			writeToFile( files[i], "finish" );
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		for( int i=0; i<testSize; ++i ) {
+			if( i % 10 == 0 ) {
+				CI_ASSERT( actions[files[i]].modified >= 1 );
+			} else {
+				CI_ASSERT( actions[files[i]].modified == 0 );
+			}
+		}
+	}
+}
+
+TEST_CASE( "CallbackExecutorTest" )
+{
+	SECTION( "Callbacks run on the executor threads and changes are detected within 2 seconds." )
+	{
+		std::vector<fs::path> files = createTestingFiles( "executor", 100 );
+		
+		filewatcher::FileWatcher::instance()->setCallbackThreads( 4 );
+		
+		std::mutex actionsMutex;
+		ActionMap actions;
+		std::thread::id mainThread = std::this_thread::get_id();
+		std::atomic<int> onMainThread( 0 );
+		std::vector<filewatcher::WatchedTarget> watches;
+		
+		{
+			filewatcher::WatchBatch batch;
+			for( auto file : files ) {
+				watches.push_back( filewatcher::FileWatcher::watchFile( file,
+					[ &actions, &actionsMutex, &onMainThread, mainThread ]( const ci::fs::path& file, filewatcher::EventType type ) {
+						if( std::this_thread::get_id() == mainThread ) {
+							++onMainThread;
+						}
+						std::lock_guard<std::mutex> lock( actionsMutex );
+						actions[file].process( type );
+					} ) );
+			}
+		}
+		
+		for( const auto &file : files ) {
+			writeToFile( file, "finish" );
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		// drains the pool before checking
+		filewatcher::FileWatcher::instance()->setCallbackThreads( 0 );
+		
+		CI_ASSERT( onMainThread == 0 );
+		CI_ASSERT( allModified( actions, files ) );
+	}
+}
+
+TEST_CASE( "UpdateBudgetTest" )
+{
+	SECTION( "A burst of changes is spread over several polls and every change is delivered." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		int testSize = 1000;
+		
+		std::vector<fs::path> files;
+		for( int i=0; i<testSize; ++i ) {
+			std::stringstream ss;
+			ss << getTestingPath().string() << "/budget" << i << ".txt";
+			files.push_back( ss.str() );
+			
+			writeToFile( files.back(), "start" );
+		}
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPath( getTestingPath(), ".*budget.*\\.txt",
+			[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				// simulates a reload
+				std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+				actions[file].process( type );
+			} );
+		
+		filewatcher::FileWatcher::instance()->setUpdateBudget( std::chrono::milliseconds( 1 ) );
+		
+		for( int i=0; i<testSize; ++i ) {
+			writeToFile( files[i], "finish" );
+		}
+		
+		// the first poll that sees the burst can't get through all of it
+		pollUntil( [ &actions ]() { return ! actions.empty(); }, std::chrono::seconds( 3 ) );
+		CI_ASSERT( filewatcher::FileWatcher::instance()->getDeferredCount() > 0 );
+		
+		// the rest drains over the following polls
+		pollFor( std::chrono::seconds( 3 ) );
+		
+		filewatcher::FileWatcher::instance()->setUpdateBudget( std::chrono::microseconds( 0 ) );
+		
+		CI_ASSERT( filewatcher::FileWatcher::instance()->getDeferredCount() == 0 );
+		for( int i=0; i<testSize; ++i ) {
+			CI_ASSERT( actions[files[i]].modified >= 1 );
+		}
+	}
+}
+
+TEST_CASE( "BatchCallbackTest" )
+{
+	SECTION( "Repeated changes arrive as batches holding each path once." )
+	{
+		std::vector<fs::path> files = createTestingFiles( "batch", 100 );
+		
+		ActionMap actions;
+		int batches = 0;
+		bool duplicates = false;
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::watchPathBatch( getTestingPath(), ".*batch.*\\.txt",
+			[ &actions, &batches, &duplicates ]( const std::vector<filewatcher::WatchEvent> &events ) {
+				++batches;
+				std::set<fs::path> seen;
+				for( const auto &event : events ) {
+					duplicates |= ! seen.insert( event.first ).second;
+					actions[event.first].process( event.second );
+				}
+			} );
+		
+		for( int pass=0; pass<3; ++pass ) {
+			for( const auto &file : files ) {
+				writeToFile( file, "finish" );
+			}
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( batches > 0 );
+		CI_ASSERT( ! duplicates );
+		CI_ASSERT( allModified( actions, files ) );
+	}
+}
+
+TEST_CASE( "ChannelTest" )
+{
+	SECTION( "Changes are pulled from a channel watch without polling the watcher." )
+	{
+		std::vector<fs::path> files = createTestingFiles( "channel", 100 );
+		
+		filewatcher::WatchedTarget watch = filewatcher::FileWatcher::instance()->addPathChannel( getTestingPath(), ".*channel.*\\.txt" );
+		
+		for( const auto &file : files ) {
+			writeToFile( file, "finish" );
+		}
+		
+		// consumes at its own cadence, FileWatcher::poll() is never called
+		ActionMap actions;
+		drainFor( watch, actions, std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( watch.getDroppedCount() == 0 );
+		CI_ASSERT( allModified( actions, files ) );
+	}
+}
+
+TEST_CASE( "WatchBudgetTest" )
+{
+	SECTION( "Roots over the watch budget are polled and swap into the stream as they heat up." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		std::vector<fs::path> dirs = { getTestingPath() / "hot", getTestingPath() / "cold" };
+		std::vector<fs::path> files;
+		for( const auto &dir : dirs ) {
+			CI_ASSERT( createTestingDir( dir ) );
+			files.push_back( dir / "file.txt" );
+			writeToFile( files.back(), "start" );
+		}
+		
+		ActionMap actions;
+		std::vector<filewatcher::WatchedTarget> watches;
+		for( const auto &dir : dirs ) {
+			watches.push_back( filewatcher::FileWatcher::watchPath( dir, ".*file\\.txt",
+				[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+					actions[file].process( type );
+				} ) );
+		}
+		
+		// one of the two roots is demoted, changes right after demotion still count
+		filewatcher::FileWatcher::instance()->setWatchBudget( 1 );
+		for( const auto &file : files ) {
+			writeToFile( file, "demoted" );
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		for( const auto &file : files ) {
+			CI_ASSERT( actions[file].modified >= 1 );
+		}
+		
+		// keep only the second root busy for longer than the heat margin so it gets promoted
+		std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + std::chrono::seconds( 3 );
+		int writes = 0;
+		while( std::chrono::system_clock::now() < waitTime ) {
+			std::stringstream ss;
+			ss << "promoted" << writes++;
+			writeToFile( files[1], ss.str() );
+			filewatcher::FileWatcher::instance()->poll();
+			ci::sleep( 1000 / 10 );
+		}
+		
+		// whichever root ended up polled, both keep reporting
+		int first = actions[files[0]].modified;
+		int second = actions[files[1]].modified;
+		for( const auto &file : files ) {
+			writeToFile( file, "swapped" );
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		filewatcher::FileWatcher::instance()->setWatchBudget( 0 );
+		
+		CI_ASSERT( actions[files[0]].modified > first );
+		CI_ASSERT( actions[files[1]].modified > second );
+	}
+}
+
+TEST_CASE( "IdleUpdateTest" )
+{
+	SECTION( "update() leaves the io_service alone until the monitor has something queued." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "idle.txt";
+		writeToFile( target, "start" );
+		
+		filewatcher::FileWatcher watcher;
+		ActionMap actions;
+		filewatcher::WatchedTarget watch = watcher.addFileWatch( target,
+			[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				actions[file].process( type );
+			} );
+		
+		// idle frames
+		for( int i=0; i<100; ++i ) {
+			watcher.update();
+		}
+		CI_ASSERT( watcher.getServicePollCount() == 0 );
+		
+		writeToFile( target, "finish" );
+		
+		std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + std::chrono::seconds( 2 );
+		
+		while( std::chrono::system_clock::now() < waitTime ) {
+			watcher.update();
+			ci::sleep( 1000 / 60 );
+		}
+		
+		CI_ASSERT( watcher.getServicePollCount() > 0 );
+		CI_ASSERT( actions[target].modified >= 1 );
+	}
+}
+
+TEST_CASE( "ImmediateDispatchTest" )
+{
+	SECTION( "Immediate dispatch delivers callbacks without poll() and the wake callback fires." )
+	{
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		
+		fs::path target = getTestingPath() / "immediate.txt";
+		writeToFile( target, "start" );
+		
+		filewatcher::FileWatcher watcher;
+		watcher.setLatency( 0.05 );
+		
+		std::atomic<int> wakes( 0 );
+		watcher.setWakeCallback( [ &wakes ]() { ++wakes; } );
+		
+		// callbacks run on the dispatch thread
+		std::atomic<int> modified( 0 );
+		filewatcher::WatchedTarget watch = watcher.addFileWatch( target,
+			[ &modified ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				if( type == filewatcher::EventType::MODIFIED ) {
+					++modified;
+				}
+			} );
+		watcher.setImmediateDispatch( true );
+		
+		writeToFile( target, "finish" );
+		
+		std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + std::chrono::seconds( 2 );
+		
+		// poll() is never called
+		while( modified == 0 && std::chrono::system_clock::now() < waitTime ) {
+			ci::sleep( 1000 / 60 );
+		}
+		
+		watcher.setImmediateDispatch( false );
+		
+		CI_ASSERT( modified >= 1 );
+		CI_ASSERT( wakes >= 1 );
+	}
+}
+
+TEST_CASE( "RouteRepublishTest" )
+{
+	SECTION( "Changes keep being routed while every registration republishes the routing table." )
+	{
+		std::vector<fs::path> files = createTestingFiles( "republish", 100 );
+		
+		ActionMap actions;
+		std::vector<filewatcher::WatchedTarget> watches;
+		for( const auto &file : files ) {
+			watches.push_back( filewatcher::FileWatcher::watchFile( file,
+				[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+					actions[file].process( type );
+				} ) );
+		}
+		
+		ActionMap pathActions;
+		filewatcher::WatchedTarget pathWatch = filewatcher::FileWatcher::watchPath( getTestingPath(), ".*republish.*\\.txt",
+			[ &pathActions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				pathActions[file].process( type );
+			} );
+		
+		// each unbatched add and remove publishes a new table while the changes are routed
+		for( size_t i = 0; i < files.size(); ++i ) {
+			fs::path churn = getTestingPath() / ( "churn" + std::to_string( i ) + ".txt" );
+			writeToFile( churn, "start" );
+			filewatcher::WatchedTarget churnWatch = filewatcher::FileWatcher::watchFile( churn,
+				[]( const ci::fs::path&, filewatcher::EventType ) { } );
+			writeToFile( files[i], "finish" );
+			filewatcher::FileWatcher::instance()->poll();
+		}
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( allModified( actions, files ) );
+		CI_ASSERT( allModified( pathActions, files ) );
+	}
+}
+
+TEST_CASE( "TraceTest" )
+{
+	// a kind of its own, the library may be tracing alongside the test
+	const uint16_t kind = 0x7e57;
+	auto ours = []( std::vector<filemonitor::TraceRecord> &records, uint16_t kind ) {
+		records.erase( std::remove_if( records.begin(), records.end(),
+			[kind]( const filemonitor::TraceRecord &record ) { return record.kind != kind; } ), records.end() );
+		return records;
+	};
+	
+	SECTION( "Records are collected in order per thread, including those of threads that exited." )
+	{
+		std::vector<filemonitor::TraceRecord> records;
+		filemonitor::Trace::collect( records );
+		records.clear();
+		
+		for( uint64_t i=0; i<100; ++i ) {
+			filemonitor::Trace::record( filemonitor::TRACE_INFO, kind, i, i * 2 );
+		}
+		std::thread worker( [kind]() {
+			filemonitor::Trace::record( filemonitor::TRACE_DEBUG, kind, 1000, 0 );
+		} );
+		worker.join();
+		
+		filemonitor::Trace::collect( records );
+		ours( records, kind );
+		CI_ASSERT( records.size() == 101 );
+		
+		std::vector<filemonitor::TraceRecord> local, remote;
+		for( const auto &record : records ) {
+			( record.a == 1000 ? remote : local ).push_back( record );
+		}
+		CI_ASSERT( local.size() == 100 && remote.size() == 1 );
+		CI_ASSERT( remote[0].thread != local[0].thread && remote[0].level == filemonitor::TRACE_DEBUG );
+		for( uint64_t i=0; i<local.size(); ++i ) {
+			CI_ASSERT( local[i].a == i && local[i].b == i * 2 && local[i].level == filemonitor::TRACE_INFO );
+			CI_ASSERT( i == 0 || local[i].time >= local[i - 1].time );
+		}
+		
+		// collecting empties the rings
+		records.clear();
+		filemonitor::Trace::collect( records );
+		CI_ASSERT( ours( records, kind ).empty() );
+	}
+	
+	SECTION( "A full ring drops and counts records instead of blocking." )
+	{
+		std::vector<filemonitor::TraceRecord> records;
+		filemonitor::Trace::collect( records );
+		records.clear();
+		
+		size_t dropped = filemonitor::Trace::dropped();
+		size_t overflow = 100;
+		for( size_t i=0; i<filemonitor::Trace::sRingCapacity + overflow; ++i ) {
+			filemonitor::Trace::record( filemonitor::TRACE_INFO, kind, i, 0 );
+		}
+		
+		filemonitor::Trace::collect( records );
+		ours( records, kind );
+		CI_ASSERT( filemonitor::Trace::dropped() >= dropped + overflow );
+		CI_ASSERT( records.size() <= filemonitor::Trace::sRingCapacity );
+		// the oldest records are kept
+		CI_ASSERT( ! records.empty() && records.front().a == 0 );
+	}
+	
+	SECTION( "Draining writes whole records to the file." )
+	{
+		std::vector<filemonitor::TraceRecord> records;
+		filemonitor::Trace::collect( records );
+		
+		fs::remove_all( getTestingPath() );
+		CI_ASSERT( createTestingDir( getTestingPath() ) );
+		fs::path file = getTestingPath() / "trace.bin";
+		
+		CI_ASSERT( filemonitor::Trace::startDrain( file.string(), std::chrono::milliseconds( 10 ) ) );
+		for( uint64_t i=0; i<10; ++i ) {
+			filemonitor::Trace::record( filemonitor::TRACE_INFO, kind, i, 0 );
+		}
+		filemonitor::Trace::stopDrain();
+		
+		uintmax_t size = fs::file_size( file );
+		CI_ASSERT( size % sizeof( filemonitor::TraceRecord ) == 0 );
+		
+		records.resize( size / sizeof( filemonitor::TraceRecord ) );
+		std::ifstream input( file.string(), std::ios::binary );
+		input.read( reinterpret_cast<char*>( records.data() ), size );
+		CI_ASSERT( ours( records, kind ).size() == 10 );
+	}
+}
@@ -8,6 +8,8 @@
 
 #include "utils.h"
 #include "FileWatcher.h"
+#include "ExcludeFilter.h"
+#include "PatternCache.h"
 
 using namespace ci;
 using namespace std;
@@ -51,15 +53,7 @@ TEST_CASE( "RegexTest" )
 		writeToFile( awesomepng, "cool2" );
 		fs::remove( remove );
 		
-		// wait 2 seconds
-		std::chrono::time_point<std::chrono::system_clock> waitTime =
-		std::chrono::system_clock::now() + std::chrono::seconds( 2 );
-		
-		// poll the service to force a check before app updates
-		while( std::chrono::system_clock::now() < waitTime ) {
-			filewatcher::FileWatcher::instance()->poll();
-			ci::sleep( 1000 / 30 );
-		}
+		pollFor( std::chrono::seconds( 2 ) );
 		
 		CI_ASSERT( actions[target].modified >= 1 );
 		CI_ASSERT( actions[dummy].modified == 0 );
@@ -170,15 +164,7 @@ TEST_CASE( "RegexTest" )
 			writeToFile( createMisses.back(), "createmiss" );
 		}
 		
-		// wait 5 seconds
-		std::chrono::time_point<std::chrono::system_clock> waitTime =
-		std::chrono::system_clock::now() + std::chrono::seconds( 5 );
-		
-		// poll the service to force a check before app updates
-		while( std::chrono::system_clock::now() < waitTime ) {
-			filewatcher::FileWatcher::instance()->poll();
-			ci::sleep( 1000 / 30 );
-		}
+		pollFor( std::chrono::seconds( 5 ) );
 		
 		// verify
 		
@@ -214,4 +200,88 @@ TEST_CASE( "RegexTest" )
 		}
 		
 	}
+	
+	SECTION( "Directory is watched with excluded subtrees and globs which never trigger the watch." )
+	{
+		fs::path root = getTestingPath();
+		fs::remove_all( root );
+		CI_ASSERT( createTestingDir( root ) );
+		
+		fs::path git = root / ".git";
+		fs::path modules = root / "sub" / "node_modules";
+		CI_ASSERT( createTestingDir( git ) );
+		CI_ASSERT( createTestingDir( root / "sub" ) );
+		CI_ASSERT( createTestingDir( modules ) );
+		
+		fs::path hit = root / "sub" / "hit.jpg";
+		fs::path gitMiss = git / "miss.jpg";
+		fs::path modulesMiss = modules / "miss.jpg";
+		fs::path tmpMiss = root / "miss.tmp";
+		
+		std::vector<std::string> excludes = { ".git/", "node_modules/", "*.tmp" };
+		
+		ActionMap actions;
+		filewatcher::WatchedTarget watchedPath;
+		
+		watchedPath = filewatcher::FileWatcher::watchPath( root, ".*",
+			[ &actions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+			  actions[file].process( type );
+			}, excludes );
+		
+		writeToFile( hit, "hit" );
+		writeToFile( gitMiss, "miss" );
+		writeToFile( modulesMiss, "miss" );
+		writeToFile( tmpMiss, "miss" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( actions[hit].added == 1 );
+		CI_ASSERT( actions[gitMiss].added == 0 && actions[gitMiss].modified == 0 );
+		CI_ASSERT( actions[modulesMiss].added == 0 && actions[modulesMiss].modified == 0 );
+		CI_ASSERT( actions[tmpMiss].added == 0 && actions[tmpMiss].modified == 0 );
+	}
+	
+	SECTION( "Excluded subtrees only apply below the watched root, not to siblings sharing its prefix." )
+	{
+		filemonitor::ExcludeFilter filter( { ".git/" } );
+		
+		CI_ASSERT( filter.excludes( "/a/b/.git/x", "/a/b" ) );
+		CI_ASSERT( filter.excludes( "/a/b/.git/x", "/a/b/" ) );
+		CI_ASSERT( ! filter.excludes( "/a/bc/.git/x", "/a/b" ) );
+	}
+	
+	SECTION( "Watches using the same expression share one compiled pattern and both trigger." )
+	{
+		filemonitor::PatternCache cache;
+		filemonitor::PatternCache::PatternRef first = cache.acquire( ".*\\.jpg" );
+		filemonitor::PatternCache::PatternRef second = cache.acquire( ".*\\.jpg" );
+		CI_ASSERT( cache.size() == 1 );
+		CI_ASSERT( first == second );
+		cache.release( ".*\\.jpg" );
+		CI_ASSERT( cache.size() == 1 );
+		cache.release( ".*\\.jpg" );
+		CI_ASSERT( cache.size() == 0 );
+		
+		fs::path root = getTestingPath();
+		fs::remove_all( root );
+		CI_ASSERT( createTestingDir( root ) );
+		
+		ActionMap firstActions, secondActions;
+		filewatcher::WatchedTarget firstWatch = filewatcher::FileWatcher::watchPath( root, ".*\\.jpg",
+			[ &firstActions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				firstActions[file].process( type );
+			} );
+		filewatcher::WatchedTarget secondWatch = filewatcher::FileWatcher::watchPath( root, ".*\\.jpg",
+			[ &secondActions ]( const ci::fs::path& file, filewatcher::EventType type ) {
+				secondActions[file].process( type );
+			} );
+		
+		fs::path hit = root / "shared.jpg";
+		writeToFile( hit, "hit" );
+		
+		pollFor( std::chrono::seconds( 2 ) );
+		
+		CI_ASSERT( firstActions[hit].added == 1 );
+		CI_ASSERT( secondActions[hit].added == 1 );
+	}
 }
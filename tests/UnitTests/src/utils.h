@@ -1,9 +1,17 @@
 #pragma once
 
 #include "cinder/app/App.h"
+#include "cinder/Utilities.h"
 
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
 #include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "FileWatcher.h"
 
@@ -65,3 +73,88 @@ inline void writeToFile( const cinder::fs::path &file, const std::string &text )
 	ofile.close();
 }
 
+
+//! Fresh testing directory holding count files named <prefix><i>.txt, each containing "start"
+inline std::vector<cinder::fs::path> createTestingFiles( const std::string &prefix, int count )
+{
+	cinder::fs::remove_all( getTestingPath() );
+	createTestingDir( getTestingPath() );
+	
+	std::vector<cinder::fs::path> files;
+	for( int i=0; i<count; ++i ) {
+		std::stringstream ss;
+		ss << getTestingPath().string() << "/" << prefix << i << ".txt";
+		files.push_back( ss.str() );
+		
+		writeToFile( files.back(), "start" );
+	}
+	return files;
+}
+
+//! Polls the default watcher for the given time
+inline void pollFor( std::chrono::seconds duration )
+{
+	std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + duration;
+	
+	// poll the service to force a check before app updates
+	while( std::chrono::system_clock::now() < waitTime ) {
+		filewatcher::FileWatcher::instance()->poll();
+		cinder::sleep( 1000 / 30 );
+	}
+}
+
+//! Polls each of watchers for the given time
+inline void pollFor( std::chrono::seconds duration, std::initializer_list<filewatcher::FileWatcher*> watchers )
+{
+	std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + duration;
+	
+	while( std::chrono::system_clock::now() < waitTime ) {
+		for( filewatcher::FileWatcher *watcher : watchers ) {
+			watcher->poll();
+		}
+		cinder::sleep( 1000 / 30 );
+	}
+}
+
+//! Polls the default watcher until done returns true or timeout passes, returns done()
+inline bool pollUntil( const std::function<bool ()> &done, std::chrono::seconds timeout )
+{
+	std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + timeout;
+	
+	while( ! done() && std::chrono::system_clock::now() < waitTime ) {
+		filewatcher::FileWatcher::instance()->poll();
+		cinder::sleep( 1000 / 30 );
+	}
+	return done();
+}
+
+//! Drains a channel watch into actions for the given time, without polling any watcher
+inline void drainFor( filewatcher::WatchedTarget &watch, ActionMap &actions, std::chrono::seconds duration )
+{
+	std::chrono::time_point<std::chrono::system_clock> waitTime =
+		std::chrono::system_clock::now() + duration;
+	
+	std::vector<filewatcher::WatchEvent> events;
+	while( std::chrono::system_clock::now() < waitTime ) {
+		events.clear();
+		watch.drain( std::back_inserter( events ) );
+		for( const auto &event : events ) {
+			actions[event.first].process( event.second );
+		}
+		cinder::sleep( 1000 / 60 );
+	}
+}
+
+//! True if every file saw at least one modification
+inline bool allModified( ActionMap &actions, const std::vector<cinder::fs::path> &files )
+{
+	for( const auto &file : files ) {
+		if( actions[file].modified < 1 ) {
+			return false;
+		}
+	}
+	return true;
+}